@@ -0,0 +1,232 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include <cstring>
+
+#include "UmColdStore.h"
+#include "UmFrameRef.h"
+#include "UmPgMagazine.h"
+#include "UmPgTblWalker.h"
+#include "umm-internal.h"
+#include "util/lz.h"
+
+namespace {
+// Exclude clones while the snapshot's entries change.
+bool claim(umm::UmSV &sv) {
+  uint32_t idle = 0;
+  if (!sv.users_.compare_exchange_strong(idle, umm::UmSV::kFreezing))
+    return false;
+  // A capture could have pinned it before the last clone went away.
+  if (sv.pinned_) {
+    sv.users_ = 0;
+    return false;
+  }
+  return true;
+}
+}
+
+void umm::UmColdStore::Init() {
+  // Setup Ebb translations
+  auto cold_root = new ColdRoot();
+  Create(cold_root, UmColdStore::global_id);
+}
+
+size_t umm::ColdRoot::Freeze(UmSV &sv) {
+  if (sv.pth.Root() == nullptr || sv.pinned_ || !claim(sv))
+    return 0;
+  {
+    std::lock_guard<ebbrt::SpinLock> guard(lock_);
+    frozen_at_[&sv] = ebbrt::clock::Wall::Now();
+  }
+  auto saved = freeze(sv);
+  sv.users_ = 0;
+  return saved;
+}
+
+size_t umm::ColdRoot::freeze(UmSV &sv) {
+  {
+    // Pages thawed since the last freeze are owned by sv again. Nothing else
+    // holds a copy of their markers, no clone is alive and sv isn't pinned.
+    std::lock_guard<ebbrt::SpinLock> guard(lock_);
+    auto &ids = owned_[&sv];
+    auto end = std::remove_if(ids.begin(), ids.end(), [this](uint64_t id) {
+      auto it = blobs_.find(id);
+      if (it->second.frame == 0)
+        return false;
+      blobs_.erase(it);
+      return true;
+    });
+    ids.erase(end, ids.end());
+  }
+
+  size_t saved = 0;
+  uint8_t buf[UMM_COLD_MAX_BLOB];
+  auto leafFn = [this, &sv, &saved, &buf](simple_pte *pte, lin_addr virt,
+                                          uint8_t lvl) {
+    // 2M pages stay resident.
+    if (lvl != TBL_LEVEL)
+      return;
+    uintptr_t page = pte->pageTabEntToAddr(TBL_LEVEL).raw;
+    // Pages some other table maps stay resident.
+    if (FrameRef::Count(page) != 1)
+      return;
+    size_t len = lz::Compress((const uint8_t *)page, kPageSize, buf,
+                              sizeof(buf));
+    if (len == 0)
+      return;
+
+    Blob b;
+    b.pte = pte;
+    b.raw = pte->raw;
+    b.data = std::unique_ptr<uint8_t[]>(new uint8_t[len]);
+    std::memcpy(b.data.get(), buf, len);
+    b.len = len;
+    b.frame = 0;
+
+    simple_pte marker;
+    marker.raw = 0;
+    marker.decompCommon.WHOCARES2 = COLD_AVL_BIT;
+    {
+      std::lock_guard<ebbrt::SpinLock> guard(lock_);
+      uint64_t id = next_id_++;
+      blobs_.emplace(id, std::move(b));
+      owned_[&sv].push_back(id);
+      frozen_++;
+      blob_bytes_ += len;
+      marker.decompCommon.PG_TBL_ADDR = id;
+    }
+    // No clone of sv is loaded anywhere, nothing to invalidate.
+    pte->raw = marker.raw;
+    UmPgTblMgmt::putFrame(page, TBL_LEVEL);
+    saved += kPageSize - len;
+  };
+  // Read only leaves too, a lazy capture's frames are only ever mapped read
+  // only. The count tells which ones nothing else maps anymore.
+  UmPgTblMgmt::walkPgTblLeaves<PTE_P, 0>(
+      sv.pth.Root(), PDPT_LEVEL, UmPgTblMgmt::kSlotWalkBase,
+      [](simple_pte *pte, uint8_t lvl) {
+        return !UmPgTblMgmt::isShared(pte);
+      },
+      leafFn);
+  return saved;
+}
+
+umm::simple_pte *umm::ColdRoot::Thaw(simple_pte *marker) {
+  kassert(UmPgTblMgmt::isCold(marker));
+  std::lock_guard<ebbrt::SpinLock> guard(lock_);
+  auto it = blobs_.find(marker->decompCommon.PG_TBL_ADDR);
+  kassert(it != blobs_.end());
+  return thaw(it->second);
+}
+
+umm::simple_pte *umm::ColdRoot::thaw(Blob &b) {
+  // Copies of the marker resolve to the page thawed first.
+  if (b.frame != 0)
+    return b.pte;
+
+  // Comes with the reference the owner's entry holds.
+  auto pfn = pg_magazine->Alloc(UmPgMagazine::data);
+  kbugon(pfn == Pfn::None());
+  b.frame = pfn.ToAddr();
+  bool ok = lz::Decompress(b.data.get(), b.len, (uint8_t *)b.frame, kPageSize);
+  kassert(ok);
+  b.data.reset();
+  frozen_--;
+  blob_bytes_ -= b.len;
+  thawed_++;
+
+  // Back to the entry it was, the snapshot owns the page again.
+  simple_pte e;
+  e.raw = b.raw;
+  e.decompCommon.PG_TBL_ADDR = b.frame >> SMALL_PG_SHIFT;
+  b.pte->raw = e.raw;
+  return b.pte;
+}
+
+void umm::ColdRoot::Track(UmSV &sv) {
+  std::lock_guard<ebbrt::SpinLock> guard(lock_);
+  sv.cold_tracked_ = true;
+  // A full idle period before the first freeze.
+  sv.last_used_ = ebbrt::clock::Wall::Now();
+  tracked_.push_back(&sv);
+  if (!timer_set_) {
+    ebbrt::timer->Start(*this, std::chrono::milliseconds(UMM_COLD_SCAN_MS),
+                        /* repeat = */ true);
+    timer_set_ = true;
+  }
+}
+
+void umm::ColdRoot::Pin(const UmSV &sv) {
+  sv.pinned_ = true;
+  // A clone is running, so sv can't be mid freeze.
+  kassert(sv.users_ != UmSV::kFreezing);
+  std::lock_guard<ebbrt::SpinLock> guard(lock_);
+  auto it = owned_.find(&sv);
+  if (it == owned_.end())
+    return;
+  for (auto id : it->second)
+    thaw(blobs_.find(id)->second);
+}
+
+void umm::ColdRoot::Forget(UmSV &sv) {
+  {
+    std::lock_guard<ebbrt::SpinLock> guard(lock_);
+    tracked_.erase(std::remove(tracked_.begin(), tracked_.end(), &sv),
+                   tracked_.end());
+    frozen_at_.erase(&sv);
+  }
+  // Fire may have claimed it already.
+  while (sv.users_ == UmSV::kFreezing)
+    __asm__ __volatile__("pause");
+
+  std::lock_guard<ebbrt::SpinLock> guard(lock_);
+  auto it = owned_.find(&sv);
+  if (it == owned_.end())
+    return;
+  for (auto id : it->second) {
+    auto b = blobs_.find(id);
+    if (b->second.frame == 0) {
+      frozen_--;
+      blob_bytes_ -= b->second.len;
+    }
+    blobs_.erase(b);
+  }
+  owned_.erase(it);
+}
+
+void umm::ColdRoot::Fire() {
+  auto now = ebbrt::clock::Wall::Now();
+  UmSV *victim = nullptr;
+  {
+    std::lock_guard<ebbrt::SpinLock> guard(lock_);
+    for (auto sv : tracked_) {
+      if (sv->pinned_ || sv->pth.Root() == nullptr)
+        continue;
+      if (now - sv->last_used_ < std::chrono::milliseconds(UMM_COLD_IDLE_MS))
+        continue;
+      // Nothing to do unless a clone ran since the last freeze.
+      auto &at = frozen_at_[sv];
+      if (at != ebbrt::clock::Wall::time_point() && sv->last_used_ < at)
+        continue;
+      if (!claim(*sv))
+        continue;
+      at = now;
+      victim = sv;
+      break;
+    }
+  }
+  // One snapshot per tick, compression keeps the core busy.
+  if (victim != nullptr) {
+    freeze(*victim);
+    victim->users_ = 0;
+  }
+}
+
+void umm::ColdRoot::dump_ctrs() {
+  std::lock_guard<ebbrt::SpinLock> guard(lock_);
+  kprintf_force("cold: %lu pages in %lu bytes, %lu thawed\n", frozen_,
+                blob_bytes_, thawed_);
+}
@@ -0,0 +1,108 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef UMM_UM_COLD_STORE_H_
+#define UMM_UM_COLD_STORE_H_
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <ebbrt/EbbId.h>
+#include <ebbrt/GlobalStaticIds.h>
+#include <ebbrt/MulticoreEbb.h>
+#include <ebbrt/SpinLock.h>
+#include <ebbrt/Timer.h>
+
+#include "UmSV.h"
+#include "umm-common.h"
+
+// Tracked snapshots unused for this long are compressed.
+#define UMM_COLD_IDLE_MS 30000
+// How often tracked snapshots are checked.
+#define UMM_COLD_SCAN_MS 1000
+// Pages that don't compress below this many bytes stay resident.
+#define UMM_COLD_MAX_BLOB (3 * 4096 / 4)
+
+namespace umm {
+
+/** Compressed pages, shared by every core */
+class ColdRoot : public ebbrt::Timer::Hook {
+public:
+  /** Compress the 4K pages sv owns, returns the bytes freed */
+  size_t Freeze(UmSV &sv);
+  /** Decompress the page behind a cold marker. Returns the entry of the
+   *  snapshot that owns the page, which is present again */
+  simple_pte *Thaw(simple_pte *marker);
+  /** Freeze sv once it has been idle for UMM_COLD_IDLE_MS */
+  void Track(UmSV &sv);
+  /** Thaw every page of sv and never freeze it again */
+  void Pin(const UmSV &sv);
+  /** Drop sv and the blobs of its pages */
+  void Forget(UmSV &sv);
+  /** Timer event handler, freezes an idle snapshot */
+  void Fire() override;
+  void dump_ctrs();
+
+private:
+  struct Blob {
+    simple_pte *pte;  // Owner's entry, restored on thaw
+    uint64_t raw;     // Owner's entry when frozen
+    std::unique_ptr<uint8_t[]> data;
+    uint32_t len;
+    uintptr_t frame;  // Thawed page, 0 while compressed
+  };
+  size_t freeze(UmSV &sv);
+  simple_pte *thaw(Blob &b);
+
+  ebbrt::SpinLock lock_;
+  std::unordered_map<uint64_t, Blob> blobs_;
+  std::unordered_map<const UmSV *, std::vector<uint64_t>> owned_;
+  std::vector<UmSV *> tracked_;
+  std::unordered_map<const UmSV *, ebbrt::clock::Wall::time_point> frozen_at_;
+  uint64_t next_id_ = 1;
+  bool timer_set_ = false;
+  // Counters
+  uint64_t frozen_ = 0;     // Pages compressed now
+  uint64_t blob_bytes_ = 0; // Bytes they take
+  uint64_t thawed_ = 0;
+};
+
+/**
+ *  UmColdStore - MultiCore Ebb holding a cold tier of snapshot pages. After a
+ *  tracked snapshot sits unused for a while its private pages are compressed
+ *  and the PTEs replaced by non present markers. Clones copy the markers like
+ *  any entry, a fault on one thaws the page back into the snapshot. Captures
+ *  thaw them, a new snapshot never holds a marker it doesn't own.
+ */
+class UmColdStore : public ebbrt::MulticoreEbb<UmColdStore, ColdRoot> {
+public:
+  /** Global EbbId */
+  static const ebbrt::EbbId global_id =
+      ebbrt::GenerateStaticEbbId("UmColdStore");
+
+  /** Class-wide static Ebb initialization */
+  static void Init();
+
+  explicit UmColdStore(const ColdRoot &root)
+      : root_(const_cast<ColdRoot &>(root)) {}
+
+  /** Compress sv now, 0 if it is in use or pinned */
+  size_t Freeze(UmSV &sv) { return root_.Freeze(sv); }
+  simple_pte *Thaw(simple_pte *marker) { return root_.Thaw(marker); }
+  void Track(UmSV &sv) { root_.Track(sv); }
+  void Pin(const UmSV &sv) { root_.Pin(sv); }
+  void Forget(UmSV &sv) { root_.Forget(sv); }
+  void dump_ctrs() { root_.dump_ctrs(); }
+
+private:
+  ColdRoot &root_;
+};
+
+/* Global reference to the cold page store */
+constexpr auto cold_store =
+    ebbrt::EbbRef<UmColdStore>(UmColdStore::global_id);
+}
+
+#endif // UMM_UM_COLD_STORE_H_
@@ -0,0 +1,115 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <cstring>
+
+#include "UmDedup.h"
+#include "UmFrameRef.h"
+#include "UmPgMagazine.h"
+#include "UmPgTblWalker.h"
+#include "umm-internal.h"
+
+namespace {
+// Four independent lanes so the multiplies overlap, then folded together.
+uint64_t page_hash(const void *page) {
+  const uint64_t k = 0x9E3779B97F4A7C15UL;
+  auto p = (const uint64_t *)page;
+  uint64_t h[4] = {k, k << 1, k << 2, k << 3};
+  for (size_t i = 0; i < kPageSize / sizeof(uint64_t); i += 4) {
+    for (int l = 0; l < 4; l++) {
+      h[l] ^= p[i + l];
+      h[l] *= k;
+      h[l] ^= h[l] >> 29;
+    }
+  }
+  return h[0] ^ (h[1] * 3) ^ (h[2] * 5) ^ (h[3] * 7);
+}
+}
+
+void umm::UmDedup::Init() {
+  // Setup Ebb translations
+  auto dedup_root = new DedupRoot();
+  Create(dedup_root, UmDedup::global_id);
+}
+
+size_t umm::UmDedup::Merge(UmSV &sv) {
+  // Delta snapshots with nothing written since the parent have no table.
+  if (sv.pth.Root() == nullptr)
+    return 0;
+  return root_.Merge(sv.pth.Root(), PDPT_LEVEL);
+}
+
+size_t umm::DedupRoot::Merge(simple_pte *root, uint8_t lvl) {
+  std::lock_guard<ebbrt::SpinLock> guard(lock_);
+  size_t saved = 0;
+
+  // Owned pages are RW, COW references belong to an ancestor or the store.
+  auto leafFn = [this, &saved](simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    // 2M pages are left alone, identical ones are rare.
+    if (lvl != TBL_LEVEL)
+      return;
+    uintptr_t page = pte->pageTabEntToAddr(TBL_LEVEL).raw;
+    // Mapped somewhere else too, the copy isn't ours to swap.
+    if (FrameRef::Count(page) != 1)
+      return;
+    uint64_t hash = page_hash((void *)page);
+
+    uintptr_t frame = 0;
+    auto range = index_.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (std::memcmp((void *)it->second, (void *)page, kPageSize) != 0)
+        continue;
+      // A frame on its way out is as good as not indexed.
+      if (FrameRef::TryGet(it->second))
+        frame = it->second;
+      break;
+    }
+
+    if (frame == 0) {
+      // First copy, indexed until its last reference goes.
+      index_.emplace(hash, page);
+      frames_[page] = hash;
+      FrameRef::SetIndexed(page);
+    } else {
+      pte->decompCommon.PG_TBL_ADDR = frame >> SMALL_PG_SHIFT;
+      bool last = FrameRef::Put(page);
+      kassert(last);
+      pg_magazine->Free(Pfn::Down(page), UmPgMagazine::data);
+      merged_++;
+      saved += kPageSize;
+    }
+
+    // The COW reference form, a write copies the frame.
+    pte->decompCommon.RW = 0;
+    pte->decompCommon.DIRTY = 1;
+  };
+  UmPgTblMgmt::walkPgTblLeaves<PTE_P, PTE_RW>(
+      root, lvl, UmPgTblMgmt::slotWalkBase(lvl),
+      [](simple_pte *pte, uint8_t lvl) {
+        return !UmPgTblMgmt::isShared(pte);
+      },
+      leafFn);
+  return saved;
+}
+
+void umm::DedupRoot::Forget(uintptr_t frame) {
+  std::lock_guard<ebbrt::SpinLock> guard(lock_);
+  auto it = frames_.find(frame);
+  kassert(it != frames_.end());
+  auto range = index_.equal_range(it->second);
+  for (auto i = range.first; i != range.second; ++i) {
+    if (i->second == frame) {
+      index_.erase(i);
+      break;
+    }
+  }
+  frames_.erase(it);
+}
+
+void umm::DedupRoot::dump_ctrs() {
+  std::lock_guard<ebbrt::SpinLock> guard(lock_);
+  kprintf_force("dedup: %lu frames indexed, %lu pages merged (%lu bytes)\n",
+                frames_.size(), merged_, merged_ * kPageSize);
+}
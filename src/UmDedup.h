@@ -0,0 +1,73 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef UMM_UM_DEDUP_H_
+#define UMM_UM_DEDUP_H_
+
+#include <unordered_map>
+
+#include <ebbrt/EbbId.h>
+#include <ebbrt/GlobalStaticIds.h>
+#include <ebbrt/MulticoreEbb.h>
+#include <ebbrt/SpinLock.h>
+
+#include "UmSV.h"
+#include "umm-common.h"
+
+namespace umm {
+
+/** Merged frames, shared by every core */
+class DedupRoot {
+public:
+  /** Move the 4K pages owned by root into the store, see UmDedup::Merge */
+  size_t Merge(simple_pte *root, uint8_t lvl);
+  /** Remove a freed frame from the index */
+  void Forget(uintptr_t frame);
+  void dump_ctrs();
+
+private:
+  ebbrt::SpinLock lock_;
+  // Content hash to indexed frames, collisions are told apart by memcmp.
+  std::unordered_multimap<uint64_t, uintptr_t> index_;
+  // Indexed frame to its hash.
+  std::unordered_map<uintptr_t, uint64_t> frames_;
+  uint64_t merged_ = 0; // Pages freed by merging
+};
+
+/**
+ *  UmDedup - MultiCore Ebb merging byte identical snapshot pages, like KSM.
+ *  Merge hashes the pages a snapshot owns against a global index of frames.
+ *  Pages matching an indexed frame are freed and remapped onto it, the rest
+ *  are indexed. Merged leaves are read only & dirty, the usual COW reference,
+ *  so a write from a clone takes the COW path in UmInstance::GetBackingPage.
+ *  Frames are refcounted like any other (see FrameRef), the index entry goes
+ *  when the frame is freed.
+ */
+class UmDedup : public ebbrt::MulticoreEbb<UmDedup, DedupRoot> {
+public:
+  /** Global EbbId */
+  static const ebbrt::EbbId global_id = ebbrt::GenerateStaticEbbId("UmDedup");
+
+  /** Class-wide static Ebb initialization */
+  static void Init();
+
+  explicit UmDedup(const DedupRoot &root)
+      : root_(const_cast<DedupRoot &>(root)) {}
+
+  /** Merge the pages sv owns, returns the bytes freed. Must run before sv is
+   *  cloned, a clone's entries would still map the pages being freed */
+  size_t Merge(UmSV &sv);
+  /** Called when an indexed frame is freed */
+  void Forget(uintptr_t frame) { root_.Forget(frame); }
+  void dump_ctrs() { root_.dump_ctrs(); }
+
+private:
+  DedupRoot &root_;
+};
+
+/* Global reference to the page deduplicator */
+constexpr auto dedup = ebbrt::EbbRef<UmDedup>(UmDedup::global_id);
+}
+
+#endif // UMM_UM_DEDUP_H_
@@ -0,0 +1,101 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <atomic>
+#include <cstring>
+
+#include <ebbrt/native/PageAllocator.h>
+
+#include "UmFrameRef.h"
+#include "UmPgTblMgr.h"
+#include "umm-internal.h"
+
+namespace {
+// Radix table over the pfn, 1024 counters to a leaf page and 512 leaves to a
+// mid page. Covers 2^28 frames, 1TB of physical memory. Nodes are allocated
+// on first touch and never freed.
+const int kLeafBits = 10;
+const int kMidBits = 9;
+const int kTopBits = 9;
+
+// High bit of a counter flags a frame indexed by UmDedup.
+const uint32_t kIndexed = 1U << 31;
+const uint32_t kCount = ~kIndexed;
+
+typedef std::atomic<uint32_t> Ctr;
+struct Leaf {
+  Ctr c[1 << kLeafBits];
+};
+struct Mid {
+  std::atomic<Leaf *> l[1 << kMidBits];
+};
+static_assert(sizeof(Leaf) == kPageSize, "Bad FrameRef leaf size");
+static_assert(sizeof(Mid) == kPageSize, "Bad FrameRef mid size");
+
+std::atomic<Mid *> top[1 << kTopBits];
+
+template <class T> T *node(std::atomic<T *> &slot) {
+  auto n = slot.load(std::memory_order_acquire);
+  if (n != nullptr)
+    return n;
+  auto pfn = ebbrt::page_allocator->Alloc();
+  kbugon(pfn == Pfn::None());
+  auto fresh = (T *)pfn.ToAddr();
+  std::memset((void *)fresh, 0, kPageSize);
+  if (slot.compare_exchange_strong(n, fresh))
+    return fresh;
+  // Another core got there first.
+  ebbrt::page_allocator->Free(pfn);
+  return n;
+}
+
+Ctr &ctr(uintptr_t frame) {
+  uint64_t pfn = frame >> SMALL_PG_SHIFT;
+  kassert((pfn >> (kLeafBits + kMidBits + kTopBits)) == 0);
+  auto mid = node(top[pfn >> (kLeafBits + kMidBits)]);
+  auto leaf = node(mid->l[(pfn >> kLeafBits) & ((1 << kMidBits) - 1)]);
+  return leaf->c[pfn & ((1 << kLeafBits) - 1)];
+}
+}
+
+void umm::FrameRef::Init(uintptr_t frame) { ctr(frame).store(1); }
+
+void umm::FrameRef::Get(uintptr_t frame) {
+  auto &c = ctr(frame);
+  // Whoever calls Get holds a reference already, the count can't hit 0 here.
+  if (c.load(std::memory_order_relaxed) & kCount)
+    c.fetch_add(1);
+}
+
+bool umm::FrameRef::TryGet(uintptr_t frame) {
+  auto &c = ctr(frame);
+  auto v = c.load();
+  do {
+    if ((v & kCount) == 0)
+      return false;
+  } while (!c.compare_exchange_weak(v, v + 1));
+  return true;
+}
+
+bool umm::FrameRef::Put(uintptr_t frame, bool *indexed) {
+  auto &c = ctr(frame);
+  if ((c.load(std::memory_order_relaxed) & kCount) == 0)
+    return false;
+  auto old = c.fetch_sub(1);
+  if ((old & kCount) != 1)
+    return false;
+  if (indexed != nullptr)
+    *indexed = old & kIndexed;
+  c.store(0);
+  return true;
+}
+
+uint32_t umm::FrameRef::Count(uintptr_t frame) {
+  return ctr(frame).load() & kCount;
+}
+
+void umm::FrameRef::SetIndexed(uintptr_t frame) {
+  ctr(frame).fetch_or(kIndexed);
+}
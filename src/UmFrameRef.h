@@ -0,0 +1,35 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef UMM_UM_FRAME_REF_H_
+#define UMM_UM_FRAME_REF_H_
+
+#include <stdint.h>
+
+namespace umm {
+
+/**
+ *  FrameRef - Reference counts of physical frames, page tables included.
+ *  A frame is counted once per page table entry that points at it, and once
+ *  for the UmPth holding a root table. Pages come out of UmPgMagazine with a
+ *  count of 1. Frames nobody counted, like the ELF image, read 0 and are
+ *  never freed. Large frames are counted on their first 4K page.
+ */
+namespace FrameRef {
+  /** Reset frame to a single reference, done by the allocator */
+  void Init(uintptr_t frame);
+  /** Take another reference, no-op on untracked frames */
+  void Get(uintptr_t frame);
+  /** Like Get but fails on a frame whose last reference is gone */
+  bool TryGet(uintptr_t frame);
+  /** Drop a reference, true if it was the last and frame should be freed.
+   *  indexed is set if UmDedup had the frame indexed */
+  bool Put(uintptr_t frame, bool *indexed = nullptr);
+  uint32_t Count(uintptr_t frame);
+  /** Flag frame as a UmDedup index entry, to be dropped with the frame */
+  void SetIndexed(uintptr_t frame);
+} // namespace FrameRef
+} // namespace umm
+
+#endif // UMM_UM_FRAME_REF_H_
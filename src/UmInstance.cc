@@ -8,6 +8,9 @@
 #include "util/x86_64.h"
 #include "UmInstance.h"
 #include "UmManager.h"
+#include "UmFrameRef.h"
+#include "UmPgCopy.h"
+#include "UmPgMagazine.h"
 #include "UmProxy.h"
 #include "umm-internal.h"
 
@@ -20,12 +23,44 @@
 
 namespace{
   std::atomic<uint32_t> umi_id_next_{1}; // UMI id counter
+
+  // True if vaddr is mapped to the shared zero frame in the loaded slot.
+  bool mapsZeroFrame(uintptr_t vaddr) {
+    umm::lin_addr la;
+    la.raw = vaddr;
+    auto pte = umm::UmPgTblMgmt::findLeafPTE(
+        umm::UmPgTblMgmt::getSlotPDPTRoot(), PDPT_LEVEL, la);
+    return pte != nullptr && pte->pageTabEntToAddr(TBL_LEVEL).raw ==
+                                 umm::UmPgMagazine::ZeroFrame();
+  }
 }
 
-umm::UmInstance::UmInstance(const umm::UmSV &sv) : sv_(sv) {
+umm::UmInstance::UmInstance(const umm::UmSV &sv) : sv_(add_user(sv)) {
   id_ = ++umi_id_next_;
+  // Only snapshots can act as a parent for delta snapshots.
+  if (sv.IsSnapshot())
+    snap_origin = &sv;
 };
 
+umm::UmInstance::~UmInstance() {
+  disable_timer();
+  // Never unloaded finished, let the next clone record instead.
+  if (ws_record)
+    sv_.ws_->Abandon();
+  if (snap_origin != nullptr) {
+    if (pfc.wssSamples)
+      snap_origin->RecordWss(pfc.wssPages);
+    snap_origin->RemoveUser();
+  }
+}
+
+const umm::UmSV &umm::UmInstance::add_user(const UmSV &sv) {
+  // Before sv_ copies the tables, the snapshot can't be frozen under us.
+  if (sv.IsSnapshot())
+    sv.AddUser();
+  return sv;
+}
+
 /** XXX: Takes a virtual address and length and marks the pages USER */ 
 // TODO: Not this..
 void hackSetPgUsr(uintptr_t vaddr, int bytes){
@@ -40,7 +75,7 @@ void hackSetPgUsr(uintptr_t vaddr, int bytes){
   umm::simple_pte *cr3 = umm::UmPgTblMgmt::getPML4Root();
   // umm::UmPgTblMgmt::dumpAllPTEsWalkLamb(la, cr3, PML4_LEVEL);
 
-  // set user  this flushes.
+  // set user, invalidates the path to la.
   umm::UmPgTblMgmt::setUserAllPTEsWalkLamb(la, cr3, PML4_LEVEL);
 
   // print path to page
@@ -74,9 +109,12 @@ void umm::UmInstance::SetArguments(const uint64_t argc,
     sv_.ef.rsi = (uint64_t)argv;
 }
 
-ebbrt::Future<umm::UmSV*> umm::UmInstance::SetCheckpoint(uintptr_t vaddr){
+ebbrt::Future<umm::UmSV*> umm::UmInstance::SetCheckpoint(uintptr_t vaddr,
+                                                        bool delta, bool lazy) {
   kassert(snap_addr == 0);
   snap_addr = vaddr;
+  snap_delta = delta;
+  snap_lazy = lazy;
   snap_p= new ebbrt::Promise<umm::UmSV*>();
   return snap_p->GetFuture();
 }
@@ -261,44 +299,97 @@ void umm::UmInstance::Print() {
   sv_.Print();
 }
 
-uintptr_t umm::UmInstance::GetBackingPage(uintptr_t v_pg_start, x86_64::PgFaultErrorCode ec) {
+uintptr_t umm::UmInstance::GetBackingPage(uintptr_t v_pg_start,
+                                          x86_64::PgFaultErrorCode ec,
+                                          uint8_t order, bool *cow_ref) {
 
-  // Consult region list.
-  umm::Region& reg = sv_.GetRegionOfAddr(v_pg_start);
+  // Consult region table.
+  const RegionTable::Entry &re = sv_.GetRegionEntry(v_pg_start);
+  umm::Region &reg = *re.reg;
   {
     reg.count++;
-    // TODO(jmcadden): Support large pages per-region
-    kassert(reg.page_order == 0);
+    // Large pages are limited to the region's page order, the manager falls
+    // back to 4K where a large page doesn't fit.
+    kassert(order == 0 || order == reg.page_order);
   }
+  const size_t pg_bytes = kPageSize << order;
+  kassert(v_pg_start % pg_bytes == 0);
 
   // Sanity check, should never wr fault to a read only section.
   // This catches writes to text, for example.
-  if(ec.isWriteFault() && !reg.writable ){
+  if(ec.isWriteFault() && !(re.flags & RegionTable::write)){
     kprintf_force(RED "I'm confused, we just write faulted on read only section" RESET, v_pg_start);
     kprintf_force(RED "%s \n" RESET, reg.name.c_str());
     while(1);
   }
 
   // If this is a fault on text or read only data, we don't allocate a page, simply map from elf.
-  // if( reg.name == ".text" || reg.name == ".rodata"){
-  if(!reg.writable){
-    // If we're not in text or rodata, it's a surprise.
-    if( ! ( reg.name == ".text" || reg.name == ".rodata") ){
-      kprintf_force(RED "Surprised to find non writable region %s \n" RESET, reg.name.c_str());
-      while(1);
-    }
-
+  // Only .text and .rodata are expected read only.
+  if(!(re.flags & RegionTable::write)){
+    if (re.flags & RegionTable::unknown)
+      kabort("Surprised to find non writable region %s\n", reg.name.c_str());
     // kprintf_force(RED "%s \n" RESET, reg.name.c_str());
+    // Elf pages are only mapped 4K.
+    kassert(order == 0);
     uintptr_t elf_pg_addr = (uintptr_t) (reg.data + reg.GetOffset(v_pg_start));
     // Must be 4k aligned.
     kassert(elf_pg_addr % (1<<12) == 0);
     return elf_pg_addr;
   }
 
+  // Delta snapshot, the page may live in an ancestor snapshot.
+  uintptr_t parent_pg = 0;
+  if (!ec.isPresent() && sv_.parent_ != nullptr) {
+    uint8_t lvl;
+    auto pte = sv_.GetParentPTE(v_pg_start, &lvl);
+    if (pte != nullptr) {
+      // Manager matches the page size of the ancestor's mapping.
+      kassert(orders[lvl] == order);
+      parent_pg = pte->pageTabEntToAddr(lvl).raw;
+      if (!ec.isWriteFault()) {
+        // Reference the parent's frame, a later write takes the COW path.
+        kassert(cow_ref != nullptr);
+        *cow_ref = true;
+        FrameRef::Get(parent_pg);
+        return parent_pg;
+      }
+    }
+  }
+
+  // Demand zero pages come pre-zeroed.
+  bool cow = ec.isPresent() && ec.isWriteFault();
+  if (!cow && !parent_pg && (re.flags & RegionTable::zero_fill)) {
+    if (re.flags & RegionTable::unknown)
+      kabort("What other case is there? %s\n", reg.name.c_str());
+#if UMM_SHARED_ZERO_FRAME
+    // Mapped read only, a write takes the COW path below.
+    if (!ec.isWriteFault() && order == 0) {
+      kassert(cow_ref != nullptr);
+      *cow_ref = true;
+      return UmPgMagazine::ZeroFrame();
+    }
+#endif
+    if (!ChargePages(1 << order))
+      return 0;
+    return pg_magazine->AllocZero(UmPgMagazine::data, order).ToAddr();
+  }
+
+#if UMM_SHARED_ZERO_FRAME
+  // First write after a read of demand zero memory, nothing to copy.
+  if (cow && order == 0 && (re.flags & RegionTable::zero_fill) &&
+      mapsZeroFrame(v_pg_start)) {
+    if (!ChargePages(1))
+      return 0;
+    return pg_magazine->AllocZero(UmPgMagazine::data).ToAddr();
+  }
+#endif
+
   /* Allocate new physical page for the faulted region */
   uintptr_t bp_start_addr;
   {
-    Pfn backing_page = ebbrt::page_allocator->Alloc();
+    if (!ChargePages(1 << order))
+      return 0;
+    Pfn backing_page = pg_magazine->Alloc(UmPgMagazine::data, order);
     kbugon(backing_page == Pfn::None());
     bp_start_addr = backing_page.ToAddr();
   }
@@ -307,29 +398,32 @@ uintptr_t umm::UmInstance::GetBackingPage(uintptr_t v_pg_start, x86_64::PgFaultE
   // We map the page in COW for 2 reasons:
   // 1) This could be a rd fault on data with a write to come later.
   // 2) When we free pages, we only free dirty pages,
-  if(ec.isPresent() && ec.isWriteFault()){
-    // Copy on write case.
-    std::memcpy((void *)bp_start_addr, (const void *)v_pg_start, kPageSize);
+  if(cow){
+    // Copy on write case, the guest is about to touch the copy. The page it
+    // replaces was read only, never charged to us.
+    PgCopy::Copy((void *)bp_start_addr, (const void *)v_pg_start, pg_bytes);
     return bp_start_addr;
   }
 
-  // Check for a backing source.
-  if (reg.data != nullptr) {
-    unsigned char *elf_src_addr = reg.data + reg.GetOffset(v_pg_start);
-    // Copy backing data onto the allocated page
-    std::memcpy((void *)bp_start_addr, (const void *)elf_src_addr, kPageSize);
-  } else if (reg.name == ".bss" || reg.name == "usr" ) {
-    // Zero bss or stack pages
-    std::memset((void *)bp_start_addr, 0, kPageSize);
-  } else {
-    kabort("What other case is there?\n");
+  // Write fault on a page owned by an ancestor snapshot.
+  if (parent_pg) {
+    PgCopy::Copy((void *)bp_start_addr, (const void *)parent_pg, pg_bytes);
+    return bp_start_addr;
   }
 
+  // Backing source.
+  kassert(reg.data != nullptr);
+  unsigned char *elf_src_addr = reg.data + reg.GetOffset(v_pg_start);
+  // Copy backing data onto the allocated page
+  std::memcpy((void *)bp_start_addr, (const void *)elf_src_addr, pg_bytes);
+
   return bp_start_addr;
 }
 
-void umm::UmInstance::logFault(x86_64::PgFaultErrorCode ec){
+void umm::UmInstance::logFault(x86_64::PgFaultErrorCode ec, uintptr_t vaddr){
   pfc.pgFaults++;
+  if (ws_record)
+    sv_.ws_->faults.push_back({Pfn::Down(vaddr).ToAddr(), ec.val});
   // Write or Read?
   if(ec.WR){
     if(ec.P){
@@ -348,6 +442,12 @@ void umm::UmInstance::PgFtCtrs::dump_ctrs(){
   kprintf_force("rd:    %lu\n", rdFaults);
   kprintf_force("wr:    %lu\n", wrFaults);
   kprintf_force("cow:   %lu\n", cowFaults);
+  if (prefetched)
+    kprintf_force("prefetch: %lu (%lu hit)\n", prefetched, prefetchHits);
+  if (coldFaults)
+    kprintf_force("cold:  %lu\n", coldFaults);
+  if (wssSamples)
+    kprintf_force("wss:   %lu pages (%lu samples)\n", wssPages, wssSamples);
 }
 
 void umm::UmInstance::PgFtCtrs::zero_ctrs(){
@@ -356,6 +456,28 @@ void umm::UmInstance::PgFtCtrs::zero_ctrs(){
   rdFaults = 0;
   wrFaults = 0;
   cowFaults = 0;
+  prefetched = 0;
+  prefetchHits = 0;
+  coldFaults = 0;
+  wssPages = 0;
+  wssSamples = 0;
+}
+
+bool umm::UmInstance::ChargePages(size_t n) {
+  if (page_quota && owned_pages_ + n > page_quota)
+    return false;
+  owned_pages_ += n;
+  return true;
+}
+
+void umm::UmInstance::UnchargePages(size_t n) {
+  kassert(n <= owned_pages_);
+  owned_pages_ -= n;
+}
+
+void umm::UmInstance::SampleWss(uint64_t pages) {
+  pfc.wssPages = wss_ewma(pfc.wssPages, pages, pfc.wssSamples == 0);
+  pfc.wssSamples++;
 }
 
 void umm::UmInstance::ZeroPFCs(){
@@ -49,6 +49,11 @@ public:
     uint64_t rdFaults = 0;
     uint64_t wrFaults = 0;
     uint64_t cowFaults = 0;
+    uint64_t prefetched = 0;   // Working set faults replayed at load
+    uint64_t prefetchHits = 0; // Replayed pages the guest touched
+    uint64_t coldFaults = 0;   // Compressed pages thawed
+    uint64_t wssPages = 0;     // Working set size estimate, in 4K pages
+    uint64_t wssSamples = 0;
   };
 
   // IP/MAC are provided here (and not in UmProxy) to allow apps access to them
@@ -66,19 +71,35 @@ public:
   // Using a reference so we don't make a redundant copy.
   // This is where the argument page table is copied.
   explicit UmInstance(const UmSV &sv); 
-  ~UmInstance(){ disable_timer(); }
+  ~UmInstance();
   /** Timer event handler */
   void Fire() override;
-  /** Resolve phyical page for virtual address */
-  uintptr_t GetBackingPage(uintptr_t vaddr, x86_64::PgFaultErrorCode ec);
-  /** Log PageFault to internal counter */
-  void logFault(x86_64::PgFaultErrorCode ec);
+  /** Resolve phyical page of 2^order pages for virtual address. Sets
+   *  cow_ref if the page belongs to an ancestor snapshot and must be mapped
+   *  read only. 0 if a new page would take the instance over page_quota */
+  uintptr_t GetBackingPage(uintptr_t vaddr, x86_64::PgFaultErrorCode ec,
+                           uint8_t order = 0, bool *cow_ref = nullptr);
+  /** Log PageFault to internal counter, and the working set if recording */
+  void logFault(x86_64::PgFaultErrorCode ec, uintptr_t vaddr = 0);
+  /** Fold a sample of the pages accessed since the last one into pfc */
+  void SampleWss(uint64_t pages);
+  /** 4K pages allocated for this instance and still mapped writable by it.
+   *  Kept by the fault path, unlike UmSV::CountOwnedPages nothing is walked */
+  size_t CountOwnedPages() const { return owned_pages_; }
+  /** Charge n 4K pages to the instance, false if they'd go over page_quota */
+  bool ChargePages(size_t n);
+  /** Give back n 4K pages the instance no longer owns */
+  void UnchargePages(size_t n);
 
   // TODO(jmcadden): Move this interface into the UmSV
   void SetArguments(const uint64_t argc, const char *argv[] = nullptr);
 
-  /** Trigger SV creation at the elf symbol located at vaddr */
-  ebbrt::Future<UmSV*> SetCheckpoint(uintptr_t vaddr);
+  /** Trigger SV creation at the elf symbol located at vaddr. A delta
+   *  snapshot only stores pages written since this instance was cloned. A
+   *  lazy one takes the dirty pages as they are and write protects them,
+   *  whichever side writes first copies */
+  ebbrt::Future<UmSV*> SetCheckpoint(uintptr_t vaddr, bool delta = false,
+                                     bool lazy = false);
 
   /* Block for (at least) `ns` nanoseconds. Inactive instance will be
    * unloaded. Execution will be yielded. */
@@ -135,12 +156,29 @@ behaviour within the execution slot.
   /** Snapshot */
   uintptr_t snap_addr = 0; // TODO: Multiple snap locations
   ebbrt::Promise<UmSV *> *snap_p;
+  bool snap_delta = false;
+  bool snap_lazy = false;
+  // Snapshot this instance was cloned from, nullptr if booted from an elf.
+  const UmSV *snap_origin = nullptr;
+  /** Working set, see UmSV::EnableWorkingSetPrefetch */
+  bool ws_record = false;   // First clone, logging faults into sv_.ws_
+  bool ws_replayed = false; // sv_.ws_ was prefetched on load
+  /** Cap on CountOwnedPages, 0 for none. A fault past it halts the instance */
+  size_t page_quota = UMM_INSTANCE_PAGE_QUOTA;
+  bool quota_exceeded = false; // Halted for going over page_quota
+  /** PCID tagging the slot translations, see UmManager::slot_load_pcid */
+  uint16_t pcid = 0;
+  size_t pcid_core = 0;
+  simple_pte *pcid_root = nullptr; // Slot root when last unloaded
 
 private:
   /* Status flags */
   bool active_ = true; // UMI is either Active or Inactive
   bool blocked_ = false; // UMI (active or inactive) can be Blocked/Unblocked
 
+  /** Count a clone of sv, see UmSV::AddUser */
+  static const UmSV &add_user(const UmSV &sv);
+
   /* Execution Management - these control the underlying event context */
   void block_execution();
   void unblock_execution();
@@ -149,6 +187,7 @@ private:
   void enable_timer(ebbrt::clock::Wall::time_point now);
   void disable_timer(); 
   bool timer_set = false;
+  size_t owned_pages_ = 0;
   ebbrt::clock::Wall::time_point clock_;
   ebbrt::clock::Wall::time_point time_wait; // block until this time
   // TODO: Computing runtime duration within the instance
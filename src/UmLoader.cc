@@ -4,6 +4,7 @@
 //          http://www.boost.org/LICENSE_1_0.txt)
 
 #include "UmLoader.h"
+#include "UmPgTblMgr.h"
 #include "UmRegion.h"
 #include "umm-internal.h"
 
@@ -33,6 +34,32 @@ uintptr_t umm::ElfLoader::GetSymbolAddress(const char *sym) {
   return 0;
 }
 
+namespace {
+// Read only leaves for the ELF's pages of reg, 2MB where the image happens to
+// be aligned like the section. The ELF is never freed, so neither are the
+// pages, and the tables are shared by every clone of the SV.
+umm::simple_pte *mapReadOnly(umm::simple_pte *root, umm::Region &reg) {
+  using namespace umm;
+  const uintptr_t end = reg.start + reg.length;
+  const bool xd = !(reg.name == ".text");
+  uintptr_t va = reg.start;
+  while (va < end) {
+    lin_addr virt, phys;
+    virt.raw = va;
+    phys.raw = (uintptr_t)(reg.data + reg.GetOffset(va));
+    unsigned char lvl = TBL_LEVEL;
+    if (va % pgBytes[DIR_LEVEL] == 0 && phys.raw % pgBytes[DIR_LEVEL] == 0 &&
+        va + pgBytes[DIR_LEVEL] <= end)
+      lvl = DIR_LEVEL;
+    // Accessed up front, hardware has no reason to write shared tables.
+    root = UmPgTblMgmt::mapIntoPgTbl(root, phys, virt, PDPT_LEVEL, lvl,
+                                     PDPT_LEVEL, false, false, xd, true);
+    va += pgBytes[lvl];
+  }
+  return root;
+}
+}
+
 umm::UmSV &
 umm::ElfLoader::createSVFromElf(unsigned char *elf_start) {
 
@@ -55,6 +82,9 @@ umm::ElfLoader::createSVFromElf(unsigned char *elf_start) {
   // Last page pointer
   uintptr_t next_page_ptr = 0;
 
+  // Tables of the immutable sections.
+  simple_pte *ro_root = nullptr;
+
   /** Elf Section Loop
   *   Iterate over each section
   */
@@ -130,9 +160,20 @@ umm::ElfLoader::createSVFromElf(unsigned char *elf_start) {
       next_page_ptr = ebbrt::Pfn::Up(reg.start + reg.length).ToAddr();
     }
 
+#if UMM_PREBUILT_RO_TABLES
+    // Code and constants never fault, clones start with them mapped. Any
+    // other read only region is left for the fault path to reject.
+    if (!reg.writable && reg.data != nullptr &&
+        (reg.name == ".text" || reg.name == ".rodata"))
+      ro_root = mapReadOnly(ro_root, reg);
+#endif
+
     ret_state.AddRegion(reg);
   } // end Elf Section loop
 
+  if (ro_root != nullptr)
+    ret_state.pth.SetRoot(ro_root);
+
   // TODO(jmcadden): Move the 'usr' and Solo5 logic out of the Elf loader
 
   // Add 'usr' region beginning the next available page
@@ -145,6 +186,7 @@ umm::ElfLoader::createSVFromElf(unsigned char *elf_start) {
   usr_reg.length = usr_len; 
   usr_reg.name = std::string("usr");
   usr_reg.writable = true;
+  usr_reg.page_order = UMM_USR_REGION_PAGE_ORDER;
   ret_state.AddRegion(usr_reg);
 
 
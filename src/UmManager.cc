@@ -5,14 +5,22 @@
 
 #include "UmManager.h"
 // TODO: Delete after debug.
+#include "UmColdStore.h"
+#include "UmDedup.h"
+#include "UmFrameRef.h"
 #include "UmPgTblMgr.h"
+#include "UmPgMagazine.h"
 #include "UmProxy.h"
 #include "UmRegion.h"
 #include "UmSyscall.h"
 #include "umm-internal.h"
 
+#include <ebbrt/native/PageAllocator.h>
 #include <ebbrt/native/VMemAllocator.h>
+#include <algorithm>
 #include <atomic>
+#include <cstring>
+#include <unordered_set>
 
 // TOGGLE DEBUG PRINT  
 #define DEBUG_PRINT_SLOT  0
@@ -46,6 +54,30 @@ umm::UmManager::UmManager(){
 #endif
   // Cycle, ins, and ref ctrs.
   ctr.init_ctrs();
+#ifdef USE_PCID
+  pcid_enabled_ = UmPgTblMgmt::enablePCID();
+#endif
+  kern_pml4_ = UmPgTblMgmt::getPML4Root();
+#ifdef USE_WSS_SAMPLER
+  ebbrt::timer->Start(wss_sampler_,
+                      std::chrono::milliseconds(UMM_WSS_SAMPLE_MS),
+                      /* repeat = */ true);
+#endif
+}
+
+void umm::UmManager::WssSampler::Fire() { umm::manager->sample_wss(); }
+
+void umm::UmManager::sample_wss() {
+  if (!slot_has_instance())
+    return;
+  auto root = getSlotPDPTRoot();
+  // ws_finish reads the accessed bits of these.
+  if (root == nullptr || active_umi_->ws_record || active_umi_->ws_replayed)
+    return;
+  UmPgTblMgmt::InvalidationTracker inv;
+  auto pages = UmPgTblMgmt::sampleAccessedPages(root, PDPT_LEVEL, inv);
+  inv.Commit();
+  active_umi_->SampleWss(pages);
 }
 
 extern "C" void ebbrt::idt::DebugException(ExceptionFrame* ef) {
@@ -67,6 +99,15 @@ void umm::UmManager::Init() {
   
   // Initialize the UmProxy Ebb
   UmProxy::Init();
+
+  // Initialize the per-core page cache
+  UmPgMagazine::Init();
+
+  // Initialize the snapshot page deduplicator
+  UmDedup::Init();
+
+  // Initialize the compressed page store
+  UmColdStore::Init();
   
   // Reserve virtual region for slot and setup a fault handler 
   auto hdlr = std::make_unique<PageFaultHandler>();
@@ -317,7 +358,7 @@ void umm::UmManager::Yield(){
 
   // If the wait queue is empty, unload the slot & queue the current instance
   if (slot_queue_size() == 0) {
-    auto old_umi = slot_unload_instance();
+    auto old_umi = slot_unload_instance(/* keep_resident = */ true);
     auto old_umi_id = old_umi->Id();
     inactive_umi_map_.emplace(old_umi_id, std::move(old_umi));
     // Push the loaded umi TO THE END OF THE QUEUE
@@ -407,13 +448,10 @@ void umm::UmManager::process_checkpoint(ebbrt::idt::ExceptionFrame *ef) {
   set_status(snapshot);
   UmSV *snap_sv = new UmSV();
   snap_sv->ef = *ef;
+  snap_sv->captured_ = true;
 
-  // Populate region list.
-  // HACK: use a assignment operator.
-  for (const auto &reg : active_umi_->sv_.region_list_) {
-    Region r = reg;
-    snap_sv->AddRegion(r);
-  }
+  // Populate region list, the instance's table is built by now.
+  snap_sv->CopyRegions(active_umi_->sv_);
 
 #if DEBUG_PRINT_SLOT
   kprintf_force(MAGENTA "C%dU%d: snapshot " RESET, (size_t)ebbrt::Cpu::GetMine(), active_umi_->Id());
@@ -423,12 +461,89 @@ void umm::UmManager::process_checkpoint(ebbrt::idt::ExceptionFrame *ef) {
 
 #endif
 
-  // Copy all dirty pages into new page table.
-  snap_sv->pth.copyInPages(getSlotPDPTRoot());
+  // The new snapshot may reference the origin's frames or link its tables,
+  // none of them may be left compressed.
+  if (active_umi_->snap_origin != nullptr) {
+#ifdef USE_COLD_STORE
+    cold_store->Pin(*active_umi_->snap_origin);
+#else
+    active_umi_->snap_origin->pinned_ = true;
+#endif
+  }
+
+  if (active_umi_->snap_delta && active_umi_->snap_origin != nullptr) {
+    // Layer the snapshot on the one this instance was cloned from, only the
+    // pages written since are stored.
+    snap_sv->parent_ = active_umi_->snap_origin;
+    snap_sv->pth.copyInDeltaPages(getSlotPDPTRoot());
+  } else if (active_umi_->snap_lazy) {
+    // Only the tables are built, the instance and the snapshot share the
+    // dirty frames read only from here on.
+    UmPgTblMgmt::InvalidationTracker inv;
+    snap_sv->pth.SetRoot(UmPgTblMgmt::walkPgTblLazyCOW(
+        getSlotPDPTRoot(), nullptr, PDPT_LEVEL, inv));
+    inv.Commit();
+    // Charged pages are exactly the writable ones, all of them are the
+    // snapshot's now. A write copies the page and charges it again.
+    active_umi_->UnchargePages(active_umi_->CountOwnedPages());
+  } else {
+    // Copy all dirty pages into new page table.
+    capture_pages(snap_sv);
+  }
+  // A full capture only stores what our tables map. Pages an ancestor of the
+  // origin holds were never faulted in, they still come from its chain,
+  // pinned when the origin was captured on top of it.
+  if (snap_sv->parent_ == nullptr)
+    snap_sv->parent_ = active_umi_->sv_.parent_;
+#ifdef USE_DEDUP
+  // Nothing has cloned the snapshot yet, safe to swap its frames.
+  dedup->Merge(*snap_sv);
+#endif
+#ifdef USE_COLD_STORE
+  cold_store->Track(*snap_sv);
+#endif
   active_umi_->snap_p->SetValue(snap_sv);
   set_status(active);
 }
 
+void umm::UmManager::capture_pages(UmSV *sv) {
+#ifdef NOCOW
+  // Deep copies stay serial.
+  sv->pth.copyInPages(getSlotPDPTRoot());
+  return;
+#endif
+  struct Capture {
+    std::vector<UmPgTblMgmt::CopyUnit> units;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> done{0};
+    // Units are claimed one at a time, a helper that starts late just finds
+    // less left.
+    void work() {
+      for (size_t i; (i = next++) < units.size(); done++)
+        UmPgTblMgmt::copyUnit(units[i]);
+    }
+  };
+  // Helpers may still be queued when we're done, the last one out frees it.
+  auto c = std::make_shared<Capture>();
+  auto copy = UmPgTblMgmt::walkPgTblCopyDirtyCOW(getSlotPDPTRoot(), nullptr,
+                                                 PDPT_LEVEL, c->units);
+
+  // Helpers read the slot's tables and pages by physical address, the slot
+  // is only mapped here. The instance is stopped until we return.
+  size_t ncpus = ebbrt::Cpu::Count();
+  size_t helpers = std::min(capture_helpers, ncpus - 1);
+  helpers = std::min(helpers, c->units.size() / UMM_CAPTURE_UNITS_PER_HELPER);
+  size_t mine = ebbrt::Cpu::GetMine();
+  for (size_t i = 1; i <= helpers; i++)
+    ebbrt::event_manager->SpawnRemote([c]() { c->work(); }, (mine + i) % ncpus);
+  c->work();
+  // Join, the faulting core can't block.
+  while (c->done < c->units.size())
+    __asm__ __volatile__("pause");
+
+  sv->pth.SetRoot(UmPgTblMgmt::linkUnits(copy, PDPT_LEVEL, c->units));
+}
+
 void umm::UmManager::PageFaultHandler::HandleFault(ExceptionFrame *ef,
                                                    uintptr_t addr) {
   umm::manager->process_pagefault(ef, addr);
@@ -477,20 +592,50 @@ void umm::UmManager::process_pagefault(ExceptionFrame *ef, uintptr_t vaddr) {
   ec.val = ef->error_code;
 
   // Increment page fault counters. Optional.
-  active_umi_->logFault(ec);
+  active_umi_->logFault(ec, vaddr);
+
+  if (!map_fault(vaddr, ec))
+    quota_halt();
+}
+
+void umm::UmManager::quota_halt() {
+  kprintf_force(RED "C%dU%d: over the page quota of %lu pages, halting\n" RESET,
+                (size_t)ebbrt::Cpu::GetMine(), active_umi_->Id(),
+                active_umi_->page_quota);
+  active_umi_->quota_exceeded = true;
+  // Nothing runs until the guest leaves the slot, it would only fault again.
+  Halt(/* drain = */ false);
+}
+
+bool umm::UmManager::map_fault(uintptr_t vaddr, x86_64::PgFaultErrorCode ec,
+                               bool prefetch) {
+  // Page of a cold snapshot, decompress it and let the access retry.
+  if (!ec.isPresent() && thaw_fault(vaddr))
+    return true;
 
   lin_addr phys, virt;
+  unsigned char mapLvl;
+  bool cowRef = false;
   {
     // This allocates a page for the umi or maps to an elf page.
     // A ptr to a backing page is the return.
     // It comes from one of 3 sources:
     // 1) If this is a copy on write (determined by the PTE existing) a page is
     //    allocated and copied from the source.
-    // 2) If it's a read only page from the ELF, it's mapped in.
+    // 2) If it's a read only page from the ELF, it's mapped in. Only without
+    //    UMM_PREBUILT_RO_TABLES, the loader maps these up front.
     // 3) If it's a zeroed page not in the ELF (like BSS or stack), it's
     //    allocated and zero filled.
-    virt.raw = Pfn::Down(vaddr).ToAddr();
-    phys.raw = active_umi_->GetBackingPage(virt.raw, ec);
+    // 4) If it belongs to an ancestor of a delta snapshot, a read maps the
+    //    ancestor's page COW and a write copies it.
+    // Regions with a large page order are backed by 2MB pages where they fit.
+    auto &re = active_umi_->sv_.GetRegionEntry(vaddr);
+    mapLvl = fault_map_level(re, vaddr, ec);
+    virt.raw = vaddr & ~(pgBytes[mapLvl] - 1);
+    phys.raw = active_umi_->GetBackingPage(virt.raw, ec, orders[mapLvl],
+                                           &cowRef);
+    if (phys.raw == 0)
+      return false;
   }
 
   // Below we map the page into the page table. There are two cases, when the
@@ -508,31 +653,41 @@ void umm::UmManager::process_pagefault(ExceptionFrame *ef, uintptr_t vaddr) {
   // If the table is not set up, root is 0 and we create it.
 
   simple_pte* pdpt;
+  UmPgTblMgmt::InvalidationTracker inv;
   {
-    umm::Region& reg = active_umi_->sv_.GetRegionOfAddr(virt.raw);
+    auto &re = active_umi_->sv_.GetRegionEntry(virt.raw);
     // Permission bits of the PTE.
     bool dirty, readWrite, execDisable;
 
     // // Set dirty bit based on page fault type. Hardware will track later writes.
-    dirty = ec.isWriteFault();
+    // COW references are marked dirty like findAndSetPTECOW does, so later
+    // snapshots carry them.
+    dirty = ec.isWriteFault() || cowRef;
 
     // Set Read and Write if the region is writable, two things to note here:
     // 1) The implementation could be a little lazier if we mapped data pages cow.
     // 2) TODO: if you set the text pages to R&W, we get a terminal page fault
     //    which tommyu does not understand. Can be reproduced by commenting in
     //    the line XXX below.
-    readWrite = (reg.writable) ? true : false;
+    readWrite = ((re.flags & RegionTable::write) && !cowRef) ? true : false;
     // // XXX: Marking text writable breaks for some reason despite no write ocuring.
     // readWrite = (reg.writable || reg.name == ".text")  ? true : false;
 
     // Have to be able to execute the text.
     // Presumably an interpreter executes on the usr segment.
-    execDisable = (reg.name == ".text" || reg.name == "usr") ? false : true;
+    execDisable = (re.flags & RegionTable::exec) ? false : true;
 
     pdpt = UmPgTblMgmt::mapIntoPgTbl(getSlotPDPTRoot(), phys, virt,
-                                     PDPT_LEVEL, TBL_LEVEL, PDPT_LEVEL,
-                                     dirty, readWrite, execDisable
+                                     PDPT_LEVEL, mapLvl, PDPT_LEVEL,
+                                     dirty, readWrite, execDisable,
+                                     !prefetch, &inv
                                      );
+
+    // Batch in the neighbours of the page, the PT was just walked. Demand
+    // zero neighbours get the zero frame, whether this was a read or a write.
+    bool zeroRef = cowRef && phys.raw == UmPgMagazine::ZeroFrame();
+    if (!ec.isPresent() && (!cowRef || zeroRef) && mapLvl == TBL_LEVEL)
+      fault_around(re, pdpt, virt, execDisable);
   }
 
   // Configure top level entry, this should be internal to the manager...
@@ -543,9 +698,206 @@ void umm::UmManager::process_pagefault(ExceptionFrame *ef, uintptr_t vaddr) {
   }
 
   // NOTE: if we're in the COW case we have to flush the stale translation!!!
-  if (ec.isPresent() && ec.isWriteFault()) {
-    umm::UmPgTblMgmt::invlpg((void *)virt.raw);
+  if (ec.isPresent() && ec.isWriteFault())
+    inv.Record(virt);
+  inv.Commit();
+  return true;
+}
+
+bool umm::UmManager::thaw_fault(uintptr_t vaddr) {
+  lin_addr la;
+  la.raw = vaddr;
+  auto pte = UmPgTblMgmt::findPTE(getSlotPDPTRoot(), PDPT_LEVEL, la, TBL_LEVEL);
+  if (pte == nullptr || !UmPgTblMgmt::isCold(pte))
+    return false;
+
+  active_umi_->pfc.coldFaults++;
+  auto owner = cold_store->Thaw(pte);
+  // The entry is the snapshot's own when reached through a shared subtree,
+  // thawing made it present. Otherwise reference the page COW.
+  if (owner != pte) {
+    pte->setPte((simple_pte *)owner->pageTabEntToAddr(TBL_LEVEL).raw, true,
+                true, false, true, owner->decompCommon.XD);
+    FrameRef::Get(owner->pageTabEntToAddr(TBL_LEVEL).raw);
+  }
+  // Was not present, nothing cached to invalidate.
+  return true;
+}
+
+unsigned char umm::UmManager::fault_map_level(const RegionTable::Entry &re,
+                                             uintptr_t vaddr,
+                                             x86_64::PgFaultErrorCode ec) {
+  lin_addr la;
+  la.raw = vaddr;
+
+  // COW faults keep the page size of the existing mapping.
+  if (ec.isPresent()) {
+    uint8_t lvl = TBL_LEVEL;
+    auto pte = UmPgTblMgmt::findLeafPTE(getSlotPDPTRoot(), PDPT_LEVEL, la, &lvl);
+    kassert(pte != nullptr);
+    return lvl;
+  }
+
+  // Delta snapshot, match the page size of the ancestor's copy.
+  auto &sv = active_umi_->sv_;
+  if (sv.parent_ != nullptr) {
+    uint8_t lvl = TBL_LEVEL;
+    if (sv.GetParentPTE(vaddr, &lvl) != nullptr)
+      return lvl;
+  }
+
+  if (re.page_order != MEDIUM_ORDER)
+    return TBL_LEVEL;
+
+  // Large page has to fit inside the region.
+  uintptr_t lg_start = vaddr & ~(pgBytes[DIR_LEVEL] - 1);
+  if (lg_start < re.start || lg_start + pgBytes[DIR_LEVEL] > re.end)
+    return TBL_LEVEL;
+
+  // Can't cover 4K pages already mapped in this range, ours or an ancestor's.
+  auto pde = UmPgTblMgmt::findPTE(getSlotPDPTRoot(), PDPT_LEVEL, la, DIR_LEVEL);
+  if (pde != nullptr && UmPgTblMgmt::exists(pde))
+    return TBL_LEVEL;
+  if (sv.parent_ != nullptr && sv.ParentMapsRange(vaddr, DIR_LEVEL))
+    return TBL_LEVEL;
+
+  return DIR_LEVEL;
+}
+
+void umm::UmManager::fault_around(const RegionTable::Entry &re,
+                                  simple_pte *root, lin_addr virt,
+                                  bool execDisable) {
+  Region &reg = *re.reg;
+  const size_t n = reg.fault_around;
+  if (n <= 1 || !(re.flags & RegionTable::around))
+    return;
+  const bool zero_fill = re.flags & RegionTable::zero_fill;
+  kassert((n & (n - 1)) == 0 && n <= 512);
+#if !UMM_SHARED_ZERO_FRAME
+  // Neighbours are only ever mapped read only, nothing to share.
+  if (zero_fill)
+    return;
+#endif
+
+  // Window is aligned, so it never leaves the faulting page's PT.
+  auto pte = UmPgTblMgmt::findPTE(root, PDPT_LEVEL, virt, TBL_LEVEL);
+  kassert(pte != nullptr && UmPgTblMgmt::exists(pte));
+  simple_pte *tbl = pte - virt[TBL_LEVEL];
+
+  const uintptr_t win_bytes = n << SMALL_PG_SHIFT;
+  const uintptr_t win_start = virt.raw & ~(win_bytes - 1);
+  // Pages of an ancestor snapshot fault through the parent chain. One look
+  // per ancestor at the window's 2MB, rather than a walk per neighbour.
+  auto &sv = active_umi_->sv_;
+  if (zero_fill && sv.parent_ != nullptr &&
+      sv.ParentMapsRange(win_start, DIR_LEVEL))
+    return;
+
+  for (uintptr_t va = win_start; va < win_start + win_bytes; va += kPageSize) {
+    if (va < re.start || va >= re.end)
+      continue;
+    lin_addr la;
+    la.raw = va;
+    simple_pte *cur = tbl + la[TBL_LEVEL];
+    if (UmPgTblMgmt::exists(cur) || UmPgTblMgmt::isCold(cur))
+      continue;
+
+    uintptr_t pg;
+    if (zero_fill) {
+      // Even around a write, the first write to a neighbour takes the zero
+      // frame COW path. Nothing is allocated or charged early.
+      pg = UmPgMagazine::ZeroFrame();
+    } else {
+      pg = (uintptr_t)(reg.data + reg.GetOffset(va));
+      kassert(pg % kPageSize == 0);
+    }
+    // Clean, a snapshot only captures the neighbours that get written.
+    // Unaccessed, so a working set recording can tell which ones were used.
+    cur->setPte((simple_pte *)pg, false, false, /* readWrite = */ false, true,
+                execDisable);
+  }
+}
+
+void umm::UmManager::ws_prefetch() {
+  auto ws = active_umi_->sv_.ws_;
+  if (!ws || active_umi_->ws_record || active_umi_->ws_replayed)
+    return;
+
+  // First clone to load records, the others wait for a complete recording.
+  auto expected = WorkingSet::empty;
+  if (ws->state.compare_exchange_strong(expected, WorkingSet::recording)) {
+    active_umi_->ws_record = true;
+    return;
+  }
+  if (expected != WorkingSet::recorded)
+    return;
+
+  active_umi_->ws_replayed = true;
+  for (const auto &f : ws->faults) {
+    x86_64::PgFaultErrorCode ec;
+    ec.val = f.ec;
+    lin_addr la;
+    la.raw = f.vaddr;
+    auto root = getSlotPDPTRoot();
+    auto pte = (root != nullptr)
+                   ? UmPgTblMgmt::findLeafPTE(root, PDPT_LEVEL, la)
+                   : nullptr;
+    // Clones start from the same tables so replay should be exact, but don't
+    // replay a fault that couldn't happen.
+    if ((pte != nullptr) != ec.isPresent())
+      continue;
+    // The rest is left to fault, or halt, in the guest.
+    if (!map_fault(f.vaddr, ec, /* prefetch = */ true))
+      break;
+    active_umi_->pfc.prefetched++;
+  }
+}
+
+void umm::UmManager::ws_finish() {
+  auto ws = active_umi_->sv_.ws_;
+  if (!ws)
+    return;
+  auto root = getSlotPDPTRoot();
+
+  if (active_umi_->ws_replayed) {
+    // Hardware sets accessed on the prefetched pages the guest used.
+    active_umi_->pfc.prefetchHits = 0;
+    for (const auto &f : ws->faults) {
+      lin_addr la;
+      la.raw = f.vaddr;
+      auto pte = UmPgTblMgmt::findLeafPTE(root, PDPT_LEVEL, la);
+      if (pte != nullptr && UmPgTblMgmt::isAccessed(pte))
+        active_umi_->pfc.prefetchHits++;
+    }
+    return;
+  }
+
+  if (!active_umi_->ws_record)
+    return;
+  // Swapped out while blocked, the recording carries on at the next load.
+  if (status() == idle)
+    return;
+  // Only a run to completion gives a full working set.
+  if (status() != finished || active_umi_->quota_exceeded) {
+    active_umi_->ws_record = false;
+    ws->Abandon();
+    return;
+  }
+
+  // Pages mapped by fault-around never faulted, pick up the used ones.
+  std::unordered_set<uintptr_t> seen;
+  for (const auto &f : ws->faults)
+    seen.insert(f.vaddr);
+  std::vector<uintptr_t> used;
+  if (root != nullptr)
+    UmPgTblMgmt::collectAccessedPrivatePages(used, root, PDPT_LEVEL);
+  for (auto va : used) {
+    if (seen.insert(va).second)
+      ws->faults.push_back({va, 0 /* read, not present */});
   }
+
+  active_umi_->ws_record = false;
+  ws->state.store(WorkingSet::recorded);
 }
 
 umm::simple_pte* umm::UmManager::getSlotPDPTRoot(){
@@ -572,6 +924,97 @@ void umm::UmManager::setSlotPDPTRoot(umm::simple_pte* newRoot){
   // (UmPgTblMgmt::getPML4Root()+ kSlotPML4Offset)->setPte(newRoot, false, true);
 }
 
+void umm::UmManager::slot_load_pcid(UmInstance *umi, simple_pte *pml4) {
+  if (!pcid_enabled_) {
+    // Resident slots are only kept with PCIDs.
+    kassert(pml4 == nullptr);
+    return;
+  }
+
+  // The old translations are good if no one else took the PCID on this core
+  // and the slot holds the same tables the instance left with.
+  size_t core = ebbrt::Cpu::GetMine();
+  auto root = (pml4 != nullptr)
+                  ? UmPgTblMgmt::nextTableOrFrame(pml4, kSlotPML4Offset,
+                                                  PML4_LEVEL)
+                  : getSlotPDPTRoot();
+  if (umi->pcid && umi->pcid_core == core &&
+      pcid_owner_[umi->pcid] == umi->Id() && root != nullptr &&
+      root == umi->pcid_root) {
+    UmPgTblMgmt::loadPCID(umi->pcid, false, pml4);
+    return;
+  }
+
+  // Take the next PCID, flushing whatever its last owner left behind.
+  auto pcid = pcid_next_;
+  pcid_next_ = (pcid_next_ % (UMM_SLOT_PCIDS - 1)) + 1;
+  pcid_owner_[pcid] = umi->Id();
+  umi->pcid = pcid;
+  umi->pcid_core = core;
+  UmPgTblMgmt::loadPCID(pcid, true, pml4);
+}
+
+umm::simple_pte *umm::UmManager::resident_load(umi::id id) {
+  for (auto &rs : resident_) {
+    if (rs.owner != id)
+      continue;
+    // Entries of the kernel may have been replaced since, see
+    // resident_share_kernel for ones added. The slot's is ours.
+    auto slot = rs.pml4[kSlotPML4Offset];
+    std::memcpy((void *)rs.pml4, (void *)kern_pml4_, kPageSize);
+    rs.pml4[kSlotPML4Offset] = slot;
+    resident_loaded_ = &rs;
+    return rs.pml4;
+  }
+  return nullptr;
+}
+
+void umm::UmManager::resident_share_kernel() {
+  // A kernel PML4 entry added while a resident PML4 is loaded would only be
+  // in the core's own, faulting forever. Filled up front, the entries never
+  // change again and new kernel mappings land in PDPTs every copy shares.
+  auto flags = kern_pml4_[0].raw & (kPageSize - 1);
+  for (int i = 0; i < 512; i++) {
+    if (i == kSlotPML4Offset || kern_pml4_[i].raw != 0)
+      continue;
+    auto pfn = ebbrt::page_allocator->Alloc();
+    kbugon(pfn == Pfn::None());
+    std::memset((void *)pfn.ToAddr(), 0, kPageSize);
+    // Other cores may be filling the same table.
+    if (!__sync_bool_compare_and_swap(&kern_pml4_[i].raw, 0,
+                                      pfn.ToAddr() | flags))
+      ebbrt::page_allocator->Free(pfn);
+  }
+}
+
+bool umm::UmManager::resident_unload(bool keep) {
+  if (resident_loaded_ != nullptr) {
+    auto rs = resident_loaded_;
+    resident_loaded_ = nullptr;
+    if (keep)
+      return true;
+    // Done with, the caller clears the entry.
+    rs->owner = umi::null_id;
+    return false;
+  }
+  if (!keep || !pcid_enabled_)
+    return false;
+
+  // Evicted instances just load the slot again, their tables are their own.
+  auto &rs = resident_[resident_next_];
+  resident_next_ = (resident_next_ + 1) % UMM_RESIDENT_SLOTS;
+  if (rs.pml4 == nullptr) {
+    auto pfn = ebbrt::page_allocator->Alloc();
+    kbugon(pfn == Pfn::None());
+    rs.pml4 = (simple_pte *)pfn.ToAddr();
+    resident_share_kernel();
+  }
+  // Slot entry included, the core's own is cleared by the caller.
+  std::memcpy((void *)rs.pml4, (void *)kern_pml4_, kPageSize);
+  rs.owner = active_umi_->Id();
+  return false;
+}
+
 ebbrt::Future<umm::umi::id>
 umm::UmManager::queue_instance_activation(std::unique_ptr<UmInstance> umi) {
   kassert(status() != empty); // Otherwise.. we should just load and run
@@ -588,7 +1031,7 @@ umm::umi::id umm::UmManager::slot_swap_instance(std::unique_ptr<UmInstance> umi)
   if (status() != empty) {
     // Only swap out a block instance
     kassert(status() == idle);
-    auto old_umi = slot_unload_instance();
+    auto old_umi = slot_unload_instance(/* keep_resident = */ true);
     auto old_umi_id = old_umi->Id();
     inactive_umi_map_.emplace(old_umi_id, std::move(old_umi));
     // Push the loaded umi TO THE END OF THE QUEUE
@@ -606,9 +1049,18 @@ umm::umi::id umm::UmManager::slot_load_instance(std::unique_ptr<UmInstance> umi)
   simple_pte *pdptRoot = getSlotPDPTRoot();
   kassert(pdptRoot == nullptr);
 
+  // Still mapped in a resident PML4, there's nothing to install.
+  simple_pte *pml4 = nullptr;
+#ifdef USE_RESIDENT_SLOTS
+  pml4 = resident_load(umi->Id());
+#endif
+
   // If we have a vaild pth root, install it.
   auto pthRoot = umi->sv_.pth.Root();
-  if(pthRoot != nullptr){
+  if (pml4 != nullptr) {
+    kassert(UmPgTblMgmt::nextTableOrFrame(pml4, kSlotPML4Offset,
+                                          PML4_LEVEL) == pthRoot);
+  } else if(pthRoot != nullptr){
     //kprintf("Installing instance pte root.\n");
     setSlotPDPTRoot(pthRoot);
     pdptRoot = getSlotPDPTRoot();
@@ -616,6 +1068,8 @@ umm::umi::id umm::UmManager::slot_load_instance(std::unique_ptr<UmInstance> umi)
     kassert(pdptRoot != nullptr);
   }
   // Otherwise leave it 0 to be populated during 1st page fault.
+  // Nothing may touch the slot before this, see slot_unload_instance.
+  slot_load_pcid(umi.get(), pml4);
 
 	// Set snapshot for this instance
   if (valid_address(umi->snap_addr)) {
@@ -626,6 +1080,8 @@ umm::umi::id umm::UmManager::slot_load_instance(std::unique_ptr<UmInstance> umi)
   proxy->SetActiveInstance(umi_id);
   active_umi_ = std::move(umi);
   set_status(loaded);
+  // Map the recorded working set before entering the guest.
+  ws_prefetch();
 #if DEBUG_PRINT_SLOT
   kprintf_force("\nC%dU%d:LD ", (size_t)ebbrt::Cpu::GetMine(), active_umi_->Id());
 #endif
@@ -633,18 +1089,38 @@ umm::umi::id umm::UmManager::slot_load_instance(std::unique_ptr<UmInstance> umi)
 }
 
 /** Internal function, unloads the Slot and clears the caches */
-std::unique_ptr<umm::UmInstance> umm::UmManager::slot_unload_instance() {
+std::unique_ptr<umm::UmInstance>
+umm::UmManager::slot_unload_instance(bool keep_resident) {
+  // Needs the slot still mapped.
+  ws_finish();
+
   // Clear slot PTE.
   simple_pte *slotPML4Ent = getSlotPML4PTE();
   kassert(UmPgTblMgmt::exists(slotPML4Ent));
-  slotPML4Ent->clearPTE();
+  active_umi_->pcid_root = getSlotPDPTRoot();
+  // Tables built from scratch on the first fault are the instance's, freed
+  // with it and reinstalled on its next load.
+  if (active_umi_->sv_.pth.Root() == nullptr)
+    active_umi_->sv_.pth.SetRoot(active_umi_->pcid_root);
+  bool resident = false;
+#ifdef USE_RESIDENT_SLOTS
+  resident = resident_unload(keep_resident);
+#endif
+  if (!resident)
+    slotPML4Ent->clearPTE();
 
-  // Modified page table, invalidate caches. This is confirmed to matter in virtualization.
-  UmPgTblMgmt::flushTranslationCaches();
+  if (pcid_enabled_) {
+    // Back to the kernel's PCID, the slot is never mapped under it. The
+    // instance's translations stay tagged for its next load.
+    UmPgTblMgmt::loadPCID(0, false, kern_pml4_);
+  } else {
+    // Modified page table, invalidate caches. This is confirmed to matter in virtualization.
+    UmPgTblMgmt::flushTranslationCaches();
+  }
 
   set_status(empty);
 
-  kassert(!UmPgTblMgmt::exists(slotPML4Ent));
+  kassert(!UmPgTblMgmt::exists(getSlotPML4PTE()));
 
 #if DEBUG_PRINT_SLOT
   kprintf_force("C%dU%d:ULD ", (size_t)ebbrt::Cpu::GetMine(), active_umi_->Id());
@@ -765,7 +1241,7 @@ void umm::UmManager::set_snapshot(uintptr_t vaddr) {
     set_status(active);
   }
 
-  void umm::UmManager::Halt() {
+  void umm::UmManager::Halt(bool drain) {
     // kprintf_force(CYAN "In halt, pth root is %p\n" RESET,
     //               active_umi_->sv_.pth.Root());
 
@@ -773,7 +1249,7 @@ void umm::UmManager::set_snapshot(uintptr_t vaddr) {
     active_umi_->SetActive(); // Prevent current instance from being swapped out
     set_status(halting);
 
-    if (ebbrt::event_manager->QueueLength()) {
+    if (drain && ebbrt::event_manager->QueueLength()) {
 #if DEBUG_PRINT_SLOT
       kprintf(
           YELLOW
@@ -32,12 +32,43 @@ const uint16_t kSlotPML4Offset = 0x180;
 // Use int 3 by default, this enables syscall mechanism.
 #define USE_SYSCALL
 
+// Tag slot translations with a PCID per instance, swaps don't flush the TLB.
+// Off until kernel mappings are global, a kernel INVLPG only drops the
+// current PCID's entry and a stale one could survive under an instance's.
+// #define USE_PCID
+// PCIDs handed out per core, round robin. PCID 0 is the kernel's.
+#define UMM_SLOT_PCIDS 32
+// Instances swapped out while blocked stay mapped in a PML4 of their own, so
+// loading one again is a cr3 write. Needs USE_PCID. Resident PML4s share the
+// kernel's PDPTs and resync its PML4 entries on load, see resident_load.
+// #define USE_RESIDENT_SLOTS
+// Resident PML4s per core, the oldest resident is evicted to make room.
+#define UMM_RESIDENT_SLOTS 4
+
+// Merge identical pages of new snapshots into shared frames, see UmDedup.
+// #define USE_DEDUP
+// Compress the pages of snapshots left idle, see UmColdStore.
+// #define USE_COLD_STORE
+
+// Sample the working set of the loaded instance from the slot's accessed bits,
+// see UmInstance::SampleWss.
+// #define USE_WSS_SAMPLER
+// Sampler period, each sample clears the accessed bits and invalidates.
+#define UMM_WSS_SAMPLE_MS 100
+
+// Other cores asked to help copy a snapshot's page tables, 0 copies serially.
+#define UMM_CAPTURE_HELPERS 3
+// Page tables to copy per helper, smaller snapshots take fewer helpers.
+#define UMM_CAPTURE_UNITS_PER_HELPER 8
+
 /**
  *  UmManager - MultiCore Ebb that manages per-core executions of SV instances
  */
 class UmManager : public ebbrt::MulticoreEbb<UmManager> {
 public:
   // int num_cp_pgs = 0;
+  /** Helpers for the next captures on this core, see capture_pages */
+  size_t capture_helpers = UMM_CAPTURE_HELPERS;
   /** Global EbbId */
   static const ebbrt::EbbId global_id = ebbrt::GenerateStaticEbbId("UmManager");
 
@@ -85,8 +116,9 @@ public:
   // TODO: Move block to inside the instance
   void Block(size_t ns);
 
-  /** Immediately halt the active instance */
-  void Halt(); 
+  /** Immediately halt the active instance. Pending events run first unless
+   *  drain is false, the fault path can't wait for them */
+  void Halt(bool drain = true);
 
   /** Signal the core to halt UMI at the next opportunity */
   void SignalHalt(umm::umi::id id); 
@@ -170,8 +202,10 @@ private:
   /** Unload the active instance 
    *  Return instance 
    *  Resulting status == 'empty'
+   *  With keep_resident the instance will run again, its slot stays mapped
+   *  in a resident PML4 if there are any, see USE_RESIDENT_SLOTS
    */
-  std::unique_ptr<UmInstance> slot_unload_instance();
+  std::unique_ptr<UmInstance> slot_unload_instance(bool keep_resident = false);
 
   /** Swap in the given instance, queue current (blocked) instance 
    *  Return umi::id of loaded instance
@@ -223,7 +257,65 @@ private:
   simple_pte* getSlotPDPTRoot();
   void setSlotPDPTRoot(simple_pte* newRoot);
   void set_status( Status s ) { return status_.set(s);}
+  unsigned char fault_map_level(const RegionTable::Entry &re, uintptr_t vaddr,
+                                x86_64::PgFaultErrorCode ec);
+  void fault_around(const RegionTable::Entry &re, simple_pte *root,
+                    lin_addr virt, bool execDisable);
+  /** True if vaddr hit a compressed page, which is mapped now */
+  bool thaw_fault(uintptr_t vaddr);
+  /** Resolve a fault, prefetched pages are mapped unaccessed. False if the
+   *  page would take the instance over its page quota, nothing is mapped */
+  bool map_fault(uintptr_t vaddr, x86_64::PgFaultErrorCode ec,
+                 bool prefetch = false);
+  /** Halt the active instance for going over its page quota */
+  void quota_halt();
+  /** Working set, start recording or replay it when loading a clone */
+  void ws_prefetch();
+  /** Working set, finish the recording or count prefetch hits */
+  void ws_finish();
   void set_snapshot(uintptr_t vaddr);
+  /** Copy the slot's dirty pages into sv, page tables are split across this
+   *  core and up to capture_helpers others */
+  void capture_pages(UmSV *sv);
+  /** Switch to the instance's PCID, reused if its translations are intact.
+   *  cr3 switches to pml4 if given */
+  void slot_load_pcid(UmInstance *umi, simple_pte *pml4 = nullptr);
+  /** Resident PML4 still mapping umi's slot, synced with the core's kernel
+   *  entries. nullptr if umi isn't resident */
+  simple_pte *resident_load(umi::id id);
+  /** Unloading, true if the slot entry of the current PML4 must stay. Keeps
+   *  the slot of an instance coming off the core's own PML4 resident */
+  bool resident_unload(bool keep);
+  /** Give every kernel entry of the core's PML4 a table. Resident PML4s
+   *  copy those, so kernel mappings made while one is in cr3 reach it */
+  void resident_share_kernel();
+
+  /** Working set sampler, see USE_WSS_SAMPLER */
+  class WssSampler : public ebbrt::Timer::Hook {
+  public:
+    void Fire() override;
+  };
+  WssSampler wss_sampler_;
+  /** Count and clear the accessed pages of the loaded instance */
+  void sample_wss();
+
+  /** PCID state, owner of each PCID on this core */
+  bool pcid_enabled_ = false;
+  umi::id pcid_owner_[UMM_SLOT_PCIDS] = {};
+  uint16_t pcid_next_ = 1;
+
+  /** Resident slots, copies of the core's PML4 that keep the slot entry of
+   *  a swapped out instance */
+  struct ResidentSlot {
+    simple_pte *pml4 = nullptr;
+    umi::id owner = umi::null_id;
+  };
+  ResidentSlot resident_[UMM_RESIDENT_SLOTS];
+  size_t resident_next_ = 0;
+  // Where the loaded instance runs, nullptr for the core's own PML4.
+  ResidentSlot *resident_loaded_ = nullptr;
+  // The core's own PML4, in cr3 unless a resident instance is loaded.
+  simple_pte *kern_pml4_ = nullptr;
 };
 
 /* Globel reference to the per-core UmManager instance */
@@ -0,0 +1,85 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <emmintrin.h>
+#ifdef UMM_PGCOPY_AVX2
+#include <immintrin.h>
+#endif
+
+#include "UmPgCopy.h"
+#include "umm-internal.h"
+
+namespace {
+// A cache line per iteration, loads ahead of stores. Prefetch a few lines out,
+// the hardware prefetcher stops at the page boundary.
+const size_t kLine = 64;
+const size_t kAhead = 4 * kLine;
+
+#ifdef UMM_PGCOPY_AVX2
+template <bool NT>
+__attribute__((target("avx2"))) void copy_avx2(void *dst, const void *src,
+                                               size_t bytes) {
+  auto d = (__m256i *)dst;
+  auto s = (const __m256i *)src;
+  for (size_t i = 0; i < bytes / sizeof(__m256i); i += 2) {
+    _mm_prefetch((const char *)(s + i) + kAhead, _MM_HINT_NTA);
+    __m256i a = _mm256_load_si256(s + i);
+    __m256i b = _mm256_load_si256(s + i + 1);
+    if (NT) {
+      _mm256_stream_si256(d + i, a);
+      _mm256_stream_si256(d + i + 1, b);
+    } else {
+      _mm256_store_si256(d + i, a);
+      _mm256_store_si256(d + i + 1, b);
+    }
+  }
+  // Upper halves are the guest's, see UmPteScan.h.
+  _mm256_zeroupper();
+}
+#endif
+
+template <bool NT> void copy_sse2(void *dst, const void *src, size_t bytes) {
+  auto d = (__m128i *)dst;
+  auto s = (const __m128i *)src;
+  for (size_t i = 0; i < bytes / sizeof(__m128i); i += 4) {
+    _mm_prefetch((const char *)(s + i) + kAhead, _MM_HINT_NTA);
+    __m128i a = _mm_load_si128(s + i);
+    __m128i b = _mm_load_si128(s + i + 1);
+    __m128i c = _mm_load_si128(s + i + 2);
+    __m128i e = _mm_load_si128(s + i + 3);
+    if (NT) {
+      _mm_stream_si128(d + i, a);
+      _mm_stream_si128(d + i + 1, b);
+      _mm_stream_si128(d + i + 2, c);
+      _mm_stream_si128(d + i + 3, e);
+    } else {
+      _mm_store_si128(d + i, a);
+      _mm_store_si128(d + i + 1, b);
+      _mm_store_si128(d + i + 2, c);
+      _mm_store_si128(d + i + 3, e);
+    }
+  }
+}
+
+template <bool NT> void copy(void *dst, const void *src, size_t bytes) {
+  kassert((uintptr_t)dst % kPageSize == 0 && (uintptr_t)src % kPageSize == 0);
+  kassert(bytes % kPageSize == 0);
+#ifdef UMM_PGCOPY_AVX2
+  copy_avx2<NT>(dst, src, bytes);
+#else
+  copy_sse2<NT>(dst, src, bytes);
+#endif
+}
+}
+
+void umm::PgCopy::Copy(void *dst, const void *src, size_t bytes) {
+  copy<false>(dst, src, bytes);
+}
+
+void umm::PgCopy::Stream(void *dst, const void *src, size_t bytes) {
+  copy<true>(dst, src, bytes);
+  // Streaming stores are weakly ordered, the page may be mapped next.
+  _mm_sfence();
+}
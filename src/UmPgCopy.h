@@ -0,0 +1,29 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef UMM_UM_PG_COPY_H_
+#define UMM_UM_PG_COPY_H_
+
+#include <stddef.h>
+
+/** UmPgCopy.h
+ *  Whole page copies. Callers pick the variant by what happens to the copy
+ *  next: Copy leaves it in cache for a guest about to touch it, Stream
+ *  writes around the cache for copies that are only kept.
+ */
+
+// 32 byte vectors. Same caveat as UMM_PTE_SCAN_AVX2, the slot's ymm state
+// isn't saved across an exit.
+// #define UMM_PGCOPY_AVX2
+
+namespace umm {
+namespace PgCopy {
+/** Copy bytes, a multiple of 4K, between page aligned buffers */
+void Copy(void *dst, const void *src, size_t bytes);
+/** Like Copy with non-temporal stores, dst is not left in cache */
+void Stream(void *dst, const void *src, size_t bytes);
+} // namespace PgCopy
+} // namespace umm
+
+#endif // UMM_UM_PG_COPY_H_
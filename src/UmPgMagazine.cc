@@ -0,0 +1,188 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <ebbrt/native/PageAllocator.h>
+
+#include <cstring>
+
+#include "UmFrameRef.h"
+#include "UmPgMagazine.h"
+#include "umm-internal.h"
+
+namespace {
+const char *pool_names[] = {"table", "data", "zero", "clean"};
+
+uintptr_t zero_frame = 0;
+
+// Non-temporal stores, zeroing a page shouldn't evict the working set.
+void zero_page_nt(void *page) {
+  auto p = (uint64_t *)page;
+  for (size_t i = 0; i < kPageSize / sizeof(uint64_t); i += 4) {
+    asm volatile("movnti %4, %0\n\t"
+                 "movnti %4, %1\n\t"
+                 "movnti %4, %2\n\t"
+                 "movnti %4, %3"
+                 : "=m"(p[i]), "=m"(p[i + 1]), "=m"(p[i + 2]), "=m"(p[i + 3])
+                 : "r"(0UL));
+  }
+}
+}
+
+void umm::UmPgMagazine::Init() {
+  // Setup multicore Ebb translation
+  Create(UmPgMagazine::global_id);
+
+  auto pfn = ebbrt::page_allocator->Alloc();
+  kbugon(pfn == Pfn::None());
+  zero_frame = pfn.ToAddr();
+  std::memset((void *)zero_frame, 0, kPageSize);
+}
+
+uintptr_t umm::UmPgMagazine::ZeroFrame() {
+  kassert(zero_frame != 0);
+  return zero_frame;
+}
+
+umm::UmPgMagazine::UmPgMagazine() {
+  // Rep is built on first use on each core, zeroing starts from there.
+  idle_zero_ = std::make_unique<ebbrt::EventManager::IdleCallback>(
+      [this]() { zero_fill(); });
+  zero_wake();
+}
+
+void umm::UmPgMagazine::zero_wake() {
+  if (zeroing_ || pool_[zero].size() >= UMM_PG_MAGAZINE_ZERO_TARGET)
+    return;
+  zeroing_ = true;
+  idle_zero_->Start();
+}
+
+ebbrt::Pfn umm::UmPgMagazine::Alloc(Pool p, uint8_t order) {
+  ebbrt::Pfn pfn;
+  if (order != 0) {
+    pfn = ebbrt::page_allocator->Alloc(order);
+  } else {
+    if (pool_[p].empty()) {
+      ctrs_[p].misses++;
+    } else {
+      ctrs_[p].hits++;
+    }
+    pfn = take(p);
+  }
+  // Pages go out with the caller's reference, see FrameRef.
+  if (pfn != Pfn::None())
+    FrameRef::Init(pfn.ToAddr());
+  return pfn;
+}
+
+ebbrt::Pfn umm::UmPgMagazine::AllocZero(Pool p, uint8_t order) {
+  kassert(p != zero && p != clean);
+
+  // Tables cleared as they were freed.
+  if (p == table && order == 0 && !pool_[clean].empty()) {
+    ctrs_[clean].hits++;
+    auto pfn = pool_[clean].back();
+    pool_[clean].pop_back();
+    FrameRef::Init(pfn.ToAddr());
+    return pfn;
+  }
+  if (p == table && order == 0)
+    ctrs_[clean].misses++;
+
+  if (order == 0 && !pool_[zero].empty()) {
+    ctrs_[zero].hits++;
+    auto pfn = pool_[zero].back();
+    pool_[zero].pop_back();
+    FrameRef::Init(pfn.ToAddr());
+    zero_wake();
+    return pfn;
+  }
+
+  // Zero synchronously.
+  if (order == 0) {
+    ctrs_[zero].misses++;
+    zero_wake();
+  }
+  auto pfn = Alloc(p, order);
+  kbugon(pfn == Pfn::None());
+  std::memset((void *)pfn.ToAddr(), 0, kPageSize << order);
+  return pfn;
+}
+
+ebbrt::Pfn umm::UmPgMagazine::take(Pool p) {
+  auto &pool = pool_[p];
+  if (pool.empty())
+    refill(p);
+  auto pfn = pool.back();
+  pool.pop_back();
+  return pfn;
+}
+
+void umm::UmPgMagazine::zero_fill() {
+  if (pool_[zero].size() >= UMM_PG_MAGAZINE_ZERO_TARGET) {
+    // Full, let the event loop halt until AllocZero drains it.
+    idle_zero_->Stop();
+    zeroing_ = false;
+    return;
+  }
+
+  ebbrt::Pfn batch[UMM_PG_MAGAZINE_ZERO_BATCH];
+  for (auto &pfn : batch) {
+    pfn = take(data);
+    zero_page_nt((void *)pfn.ToAddr());
+  }
+  // Order the weakly ordered stores before a page can be handed out.
+  asm volatile("sfence" ::: "memory");
+  for (auto &pfn : batch)
+    pool_[zero].push_back(pfn);
+  ctrs_[zero].refills++;
+}
+
+void umm::UmPgMagazine::Free(ebbrt::Pfn pfn, Pool p, uint8_t order) {
+  if (order != 0) {
+    ebbrt::page_allocator->Free(pfn, order);
+    return;
+  }
+
+  auto &pool = pool_[p];
+  pool.push_back(pfn);
+  if (pool.size() > UMM_PG_MAGAZINE_MAX)
+    drain(p);
+}
+
+void umm::UmPgMagazine::refill(Pool p) {
+  // One allocator call for a batch of pages, handed out individually.
+  auto block = ebbrt::page_allocator->Alloc(UMM_PG_MAGAZINE_REFILL_ORDER);
+  kbugon(block == Pfn::None());
+  ctrs_[p].refills++;
+
+  auto &pool = pool_[p];
+  for (size_t i = 0; i < (1 << UMM_PG_MAGAZINE_REFILL_ORDER); i++)
+    pool.push_back(block + i);
+}
+
+void umm::UmPgMagazine::drain(Pool p) {
+  // Return the coldest half, the allocator coalesces buddies as they come back.
+  auto &pool = pool_[p];
+  size_t n = pool.size() / 2;
+  for (size_t i = 0; i < n; i++)
+    ebbrt::page_allocator->Free(pool[i], 0);
+  pool.erase(pool.begin(), pool.begin() + n);
+  ctrs_[p].drains++;
+}
+
+void umm::UmPgMagazine::dump_ctrs() {
+  for (int p = 0; p < num_pools; p++) {
+    kprintf_force("%s pool: %lu hit, %lu miss, %lu refill, %lu drain, %lu "
+                  "cached\n",
+                  pool_names[p], ctrs_[p].hits, ctrs_[p].misses,
+                  ctrs_[p].refills, ctrs_[p].drains, pool_[p].size());
+  }
+}
+
+void umm::UmPgMagazine::zero_ctrs() {
+  for (auto &c : ctrs_)
+    c = PoolCtrs();
+}
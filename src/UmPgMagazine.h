@@ -0,0 +1,96 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef UMM_UM_PG_MAGAZINE_H_
+#define UMM_UM_PG_MAGAZINE_H_
+
+#include <memory>
+#include <vector>
+
+#include <ebbrt/EbbId.h>
+#include <ebbrt/EventManager.h>
+#include <ebbrt/GlobalStaticIds.h>
+#include <ebbrt/MulticoreEbb.h>
+
+#include "umm-common.h"
+
+// Pages pulled from the page allocator per refill, 2^i pages.
+#define UMM_PG_MAGAZINE_REFILL_ORDER 5
+// A pool holding more than this many pages drains half back.
+#define UMM_PG_MAGAZINE_MAX (4 << UMM_PG_MAGAZINE_REFILL_ORDER)
+// Pre-zeroed pages kept per core, topped up from the idle loop.
+#define UMM_PG_MAGAZINE_ZERO_TARGET 64
+// Pages zeroed per idle callback, keeps the event loop responsive.
+#define UMM_PG_MAGAZINE_ZERO_BATCH 8
+
+namespace umm {
+
+/**
+ *  UmPgMagazine - MultiCore Ebb caching 4K pages for page faults and page
+ *  tables. Refills from and drains to the EbbRT page allocator in bulk so the
+ *  fault path rarely leaves the core. Larger orders pass straight through.
+ *  A third pool of pages is zeroed ahead of time while the core is idle.
+ *  Page tables are freed with the entries they had set cleared, they go to a
+ *  pool of their own and come back out of AllocZero without a memset.
+ */
+class UmPgMagazine : public ebbrt::MulticoreEbb<UmPgMagazine> {
+public:
+  /** Global EbbId */
+  static const ebbrt::EbbId global_id =
+      ebbrt::GenerateStaticEbbId("UmPgMagazine");
+
+  /** Class-wide static Ebb initialization */
+  static void Init();
+
+  UmPgMagazine();
+
+  /** Page table pages and backing pages are cached separately, zero holds
+   *  pre-zeroed pages for either and clean freed tables with no entry set */
+  enum Pool : uint8_t { table = 0, data, zero, clean, num_pools };
+
+  /** Pool counters */
+  struct PoolCtrs {
+    uint64_t hits = 0;
+    uint64_t misses = 0;  // Allocations that had to refill
+    uint64_t refills = 0;
+    uint64_t drains = 0;
+  };
+
+  /** Allocate 2^order pages, only order 0 is served from the pool */
+  ebbrt::Pfn Alloc(Pool p, uint8_t order = 0);
+  /** Allocate 2^order zeroed pages for pool p, popped from the clean (tables
+   *  only) or zero pool when possible */
+  ebbrt::Pfn AllocZero(Pool p, uint8_t order = 0);
+  /** Free 2^order pages, only order 0 is kept in the pool. Pages freed to
+   *  clean must be all zero */
+  void Free(ebbrt::Pfn pfn, Pool p, uint8_t order = 0);
+  /** The 4K frame of zeros mapped read only by read faults on demand zero
+   *  memory. Not counted by FrameRef, it's never freed */
+  static uintptr_t ZeroFrame();
+
+  void dump_ctrs();
+  void zero_ctrs();
+
+private:
+  ebbrt::Pfn take(Pool p);
+  void refill(Pool p);
+  void drain(Pool p);
+  /** Idle callback, zeroes a batch of pages into the zero pool. Stops itself
+   *  once the pool is full so an idle core can halt */
+  void zero_fill();
+  /** Start the idle callback again if the zero pool ran low */
+  void zero_wake();
+
+  std::vector<ebbrt::Pfn> pool_[num_pools];
+  PoolCtrs ctrs_[num_pools];
+  std::unique_ptr<ebbrt::EventManager::IdleCallback> idle_zero_;
+  bool zeroing_ = false;
+};
+
+/* Global reference to the per-core page magazine */
+constexpr auto pg_magazine =
+    ebbrt::EbbRef<UmPgMagazine>(UmPgMagazine::global_id);
+}
+
+#endif // UMM_UM_PG_MAGAZINE_H_
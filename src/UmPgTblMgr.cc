@@ -11,6 +11,13 @@
 #include "UmManager.h"  // hack to get per core copied pages count.
 #include "UmPgTblMgr.h"
 #include "UmManager.h"
+#include "UmColdStore.h"
+#include "UmDedup.h"
+#include "UmFrameRef.h"
+#include "UmPgCopy.h"
+#include "UmPgMagazine.h"
+#include "UmPgTblWalker.h"
+#include "util/x86_64.h"
 // #include <Umm.h>
 #include <vector>
 
@@ -34,46 +41,239 @@ using namespace umm;
 using umm::lin_addr;
 using umm::simple_pte;
 
-UmPgTblMgmt::beforeRecFn nullBRFn   = [](simple_pte *curPte, uint8_t lvl){};
-UmPgTblMgmt::afterRecFn  nullARFn   = [](simple_pte *childPte, simple_pte *curPte, uint8_t lvl){};
-UmPgTblMgmt::leafFn      nullLFn    = nullBRFn;
-UmPgTblMgmt::beforeRetFn nullBRetFn = nullBRFn;
-
-void UmPgTblMgmt::freePageTableLamb(simple_pte *root, unsigned char lvl){
-  // Free leaves.
-  auto leafFn = [](simple_pte *curPte, uint8_t lvl){
-    // NOTE: Rule we use here is only free page if you have write access!!!
-    if( curPte->decompCommon.RW == 1){
-    ebbrt::Pfn myPFN = ebbrt::Pfn::Down(curPte->pageTabEntToAddr(lvl).raw);
-    // kprintf(RED "Free physical page at %p\n" RESET, myPFN.ToAddr());
-
-    kassert(orders[lvl] == 0);
-
-    ebbrt::page_allocator->Free(myPFN, orders[lvl]);
+namespace {
+// Visitors for the templated walker, see UmPgTblWalker.h. The PTE bit
+// filters pick entries out of a table scan, Visit() only sees those.
+
+// Drops the references the walked tables hold, see FrameRef. Only tables whose
+// last reference goes are walked, each one frees the frames nobody else maps.
+// Every entry that was set is visited and cleared on the way, so freed tables
+// are zero and can be reused without a memset.
+struct FreeVisitor : UmPgTblMgmt::PgTblVisitor {
+  static constexpr bool kCold = true;
+  void Leaf(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    // 1G NYI.
+    kassert(lvl <= DIR_LEVEL);
+    UmPgTblMgmt::putFrame(pte->pageTabEntToAddr(lvl).raw, lvl);
+    pte->raw = 0;
+  }
+  bool Enter(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    if (FrameRef::Put(pte->pageTabEntToAddr(lvl).raw))
+      return true;
+    // Subtree still shared with a snapshot or clone.
+    pte->raw = 0;
+    return false;
+  }
+  void Leave(simple_pte *pte, lin_addr virt, uint8_t lvl) { pte->raw = 0; }
+  // The blob belongs to the snapshot that owns the page.
+  void Cold(simple_pte *pte, lin_addr virt) { pte->raw = 0; }
+  void Exit(simple_pte *table, uint8_t lvl) {
+    // Tables must be 1 4k page.
+    pg_magazine->Free(ebbrt::Pfn::Down(table), UmPgMagazine::clean);
+  }
+};
+
+// Copiers build copy, a table of the slot at copyLvl (the PDPT unless copying
+// a single CopyUnit), from the walked one.
+struct CopyVisitor : UmPgTblMgmt::PgTblVisitor {
+  explicit CopyVisitor(simple_pte *c, uint8_t l = PDPT_LEVEL)
+      : copy(c), copyLvl(l) {}
+  // Allocate new page, copy the leaf's page onto it and map it.
+  void deepCopy(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    lin_addr backing;
+    backing.raw = pte->pageTabEntToAddr(lvl).raw;
+    lin_addr phys = UmPgTblMgmt::copyDirtyPage(backing, lvl);
+    copy = UmPgTblMgmt::mapIntoPgTbl(copy, phys, virt, copyLvl, lvl,
+                                     copyLvl, true);
+  }
+  // Read only reference to the leaf's page.
+  void cowRef(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    copy = UmPgTblMgmt::findAndSetPTECOW(copy, pte, virt, copyLvl, lvl,
+                                         copyLvl);
+  }
+  // The blob goes when the snapshot that owns it does, which may be before
+  // the copy. Thaw the page and take a read only reference to it instead.
+  void Cold(simple_pte *pte, lin_addr virt) {
+    simple_pte *owner = cold_store->Thaw(pte);
+    cowRef(owner, virt, TBL_LEVEL);
+  }
+  simple_pte *copy;
+  uint8_t copyLvl;
+};
+
+struct CopyDirtyVisitor : CopyVisitor {
+  using CopyVisitor::CopyVisitor;
+  static constexpr uint64_t kLeafBits = PTE_D;
+  static constexpr bool kCold = true;
+  void Leaf(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    // 1G NYI.
+    kassert(lvl <= DIR_LEVEL);
+    deepCopy(pte, virt, lvl);
+  }
+};
+
+struct COWVisitor : CopyVisitor {
+  using CopyVisitor::CopyVisitor;
+  // TODO: I think we can do this for all pages, not just dirty.
+  static constexpr uint64_t kLeafBits = PTE_D;
+  static constexpr bool kCold = true;
+  void Leaf(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    // 1G NYI.
+    kassert(lvl <= DIR_LEVEL);
+    cowRef(pte, virt, lvl);
+  }
+};
+
+struct CopyDirtyCOWVisitor : CopyVisitor {
+  using CopyVisitor::CopyVisitor;
+  static constexpr uint64_t kLeafBits = PTE_D;
+  static constexpr bool kCold = true;
+  void Leaf(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    // 1G NYI.
+    kassert(lvl <= DIR_LEVEL);
+    if (pte->decompCommon.RW == 1) {
+      // This page was faulted in during the running of this instance, need
+      // deep copy.
+      deepCopy(pte, virt, lvl);
+    } else {
+      // This is just a pointer to a page that exists in a previous
+      // snapshot. Just create a pointer here.
+      cowRef(pte, virt, lvl);
     }
-  };
+  }
+  bool Enter(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    if (!UmPgTblMgmt::isShared(pte))
+      return true;
+    // Untouched since the clone, link the snapshot's subtree as is.
+    copy = UmPgTblMgmt::findAndSetPTE(copy, pte, virt, PDPT_LEVEL, lvl,
+                                      PDPT_LEVEL);
+    return false;
+  }
+};
+
+struct LazyCOWVisitor : CopyDirtyCOWVisitor {
+  LazyCOWVisitor(simple_pte *c, UmPgTblMgmt::InvalidationTracker &i)
+      : CopyDirtyCOWVisitor(c), inv(i) {}
+  void Leaf(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    // 1G NYI.
+    kassert(lvl <= DIR_LEVEL);
+    // Ours until now, the copy shares it so a write must fault.
+    if (pte->decompCommon.RW == 1) {
+      pte->decompCommon.RW = 0;
+      inv.Record(virt);
+    }
+    cowRef(pte, virt, lvl);
+  }
+  UmPgTblMgmt::InvalidationTracker &inv;
+};
+
+// Page tables go to units instead of being walked, everything above them is
+// copied as V would.
+template <class V> struct SplitVisitor : V {
+  SplitVisitor(simple_pte *c, std::vector<UmPgTblMgmt::CopyUnit> &u)
+      : V(c), units(u) {}
+  bool Enter(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    if (!V::Enter(pte, virt, lvl))
+      return false;
+    if (lvl != DIR_LEVEL)
+      return true;
+    units.push_back({UmPgTblMgmt::nextTableOrFrame(pte, 0, lvl), virt,
+                     nullptr});
+    return false;
+  }
+  std::vector<UmPgTblMgmt::CopyUnit> &units;
+};
+
+struct CopyDeltaVisitor : CopyVisitor {
+  using CopyVisitor::CopyVisitor;
+  // Read only dirty leaves are skipped entirely. They reference frames of an
+  // ancestor snapshot, which the child resolves by faulting through its
+  // parent chain instead of storing a PTE.
+  static constexpr uint64_t kLeafBits = PTE_D | PTE_RW;
+  void Leaf(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    // 1G NYI.
+    kassert(lvl <= DIR_LEVEL);
+    deepCopy(pte, virt, lvl);
+  }
+  bool Enter(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    // Shared subtrees hold nothing written since the clone.
+    return !UmPgTblMgmt::isShared(pte);
+  }
+};
 
-  // Free tables.
-  auto bretFn = [](simple_pte *root, uint8_t lvl){
-    ebbrt::Pfn myPFN = ebbrt::Pfn::Down(root);
-    // kprintf(CYAN "Free page table at %p\n" RESET, myPFN.ToAddr());
+// Leaf counters, counts[lvl] of each leaf passing the filter.
+struct CountLeaves {
+  explicit CountLeaves(std::vector<uint64_t> &c) : counts(c) {}
+  void operator()(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    counts[lvl]++;
+  }
+  std::vector<uint64_t> &counts;
+};
+
+// Nothing past the bit filters.
+auto anyFn = [](simple_pte *pte, uint8_t lvl) -> bool { return true; };
+auto notSharedFn = [](simple_pte *pte, uint8_t lvl) -> bool {
+  return !UmPgTblMgmt::isShared(pte);
+};
+
+// Prints each hook as the walker calls it, see printTraversalLamb.
+struct PrintVisitor : UmPgTblMgmt::PgTblVisitor {
+  void Leaf(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    printf("At leaf\n");
+  }
+  bool Enter(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    printf("Before Recursion\n");
+    return true;
+  }
+  void Leave(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    printf("After Recursion\n");
+  }
+  void Exit(simple_pte *table, uint8_t lvl) { printf("About to return\n"); }
+};
+
+// Walk down to the leaf mapping virt, calling R on every entry on the way and
+// returning what L makes of the leaf. virt must be mapped, see findLeafPTE.
+template <class R, class L>
+uintptr_t walkPageTable(simple_pte *root, uint8_t lvl, lin_addr virt, R rec,
+                        L leaf) {
+  for (;;) {
+    simple_pte *curPte = root + virt[lvl];
+    rec(curPte, virt, lvl);
+    if (UmPgTblMgmt::isLeaf(curPte, lvl))
+      return leaf(curPte, virt, lvl);
+    root = UmPgTblMgmt::nextTableOrFrame(root, virt[lvl], lvl);
+    lvl--;
+  }
+}
 
-    // Tables must be 1 4k page.
-    int order = 0;
-    ebbrt::page_allocator->Free(myPFN, order);
-  };
+template <class L>
+uintptr_t walkPageTable(simple_pte *root, uint8_t lvl, lin_addr virt, L leaf) {
+  return walkPageTable(root, lvl, virt,
+                       [](simple_pte *, lin_addr, uint8_t) {}, leaf);
+}
+} // namespace
 
-  traverseAccessedPages(root, lvl, leafFn, bretFn);
+void UmPgTblMgmt::freePageTableLamb(simple_pte *root, unsigned char lvl){
+  if (!FrameRef::Put((uintptr_t)root))
+    return;
+  FreeVisitor v;
+  walkPgTbl(root, lvl, 0, v);
+}
+
+void UmPgTblMgmt::putFrame(uintptr_t frame, uint8_t lvl){
+  bool indexed = false;
+  if (!FrameRef::Put(frame, &indexed))
+    return;
+  if (indexed)
+    dedup->Forget(frame);
+  pg_magazine->Free(ebbrt::Pfn::Down(frame), UmPgMagazine::data, orders[lvl]);
 }
 
 // NOTE: World of lambdas begins here.
 void UmPgTblMgmt::countValidPagesLamb(std::vector<uint64_t> &counts,
                                 simple_pte *root, uint8_t lvl) {
   // Counts number mapped pages.
-  auto leafFn = [&counts](simple_pte *curPte, uint8_t lvl){
-    counts[lvl]++;
-  };
-  traverseValidPages(root, lvl, leafFn);
+  walkPgTblLeaves<PTE_P, 0>(root, lvl, 0, anyFn, CountLeaves(counts));
 }
 
 // void UmPgTblMgmt::countValidWritePagesLamb(std::vector<uint64_t> &counts,
@@ -95,150 +295,73 @@ void UmPgTblMgmt::doubleCacheInvalidate(simple_pte *root, uint8_t lvl){
 
 void UmPgTblMgmt::cacheInvalidateValidPagesLamb(simple_pte *root, uint8_t lvl) {
   // Counts number mapped pages.
-  auto leafFn = [](simple_pte *curPte, uint8_t lvl){
+  auto leafFn = [](simple_pte *curPte, lin_addr virt, uint8_t lvl) {
     invlpg(nextTableOrFrame(curPte, 0, lvl));
   };
-  traverseValidPages(const_cast<umm::simple_pte*>(root), lvl, leafFn);
+  walkPgTblLeaves<PTE_P, 0>(root, lvl, 0, anyFn, leafFn);
 }
 
 void UmPgTblMgmt::countValidPTEsLamb(std::vector<uint64_t> &counts,
                                      simple_pte *root, uint8_t lvl) {
   // Little bit of a HACK to put this in the predicate, but whatever.
   auto pred = [&counts](simple_pte *curPte, uint8_t lvl) -> bool {
-    bool ret = exists(curPte);
-    if(ret){
-      counts[lvl]++;
-    }
-    return ret;
+    counts[lvl]++;
+    return true;
   };
-  traversePageTable(root, lvl, pred, nullBRFn, nullARFn, nullLFn, nullBRetFn );
+  walkPgTblLeaves<PTE_P, 0>(root, lvl, 0, pred,
+                  [](simple_pte *curPte, lin_addr virt, uint8_t lvl) {});
 }
 
 void UmPgTblMgmt::countAccessedPagesLamb(std::vector<uint64_t> &counts,
                                      simple_pte *root, uint8_t lvl) {
   // Counts number mapped pages.
-  auto leafFn = [&counts](simple_pte *curPte, uint8_t lvl){
-    counts[lvl]++;
-  };
-  traverseAccessedPages(root, lvl, leafFn);
+  walkPgTblLeaves<PTE_P | PTE_A, 0>(root, lvl, 0, anyFn, CountLeaves(counts));
 }
 
 void UmPgTblMgmt::countDirtyPagesLamb(std::vector<uint64_t> &counts,
                                      simple_pte *root, uint8_t lvl) {
   // Counts number dirty pages.
-  auto leafFn = [&counts](simple_pte *curPte, uint8_t lvl){
-    if(isLeaf(curPte, lvl))
-      if(isDirty(curPte))
-      counts[lvl]++;
-  };
   // NOTE: Trying walking accessed, not valid.
-  traverseAccessedPages(root, lvl, leafFn);
+  walkPgTblLeaves<PTE_P | PTE_A, PTE_D>(root, lvl, 0, anyFn,
+                                        CountLeaves(counts));
 }
 
 void UmPgTblMgmt::countWritablePagesLamb(std::vector<uint64_t> &counts,
                                       simple_pte *root, uint8_t lvl) {
-  // Counts number dirty pages.
-  auto leafFn = [&counts](simple_pte *curPte, uint8_t lvl){
-                  if(isLeaf(curPte, lvl))
-                    if(isWritable(curPte))
-                      counts[lvl]++;
-                };
-  // NOTE: Trying walking accessed, not valid.
-  traverseAccessedPages(root, lvl, leafFn);
+  // Counts writable pages, shared subtrees aren't ours.
+  walkPgTblLeaves<PTE_P, PTE_RW>(root, lvl, 0, notSharedFn,
+                                 CountLeaves(counts));
 }
-void UmPgTblMgmt::printTraversalLamb(simple_pte *root, uint8_t lvl) {
-  // Dummy example for how one might use the general traverser.
-  auto predicate = [](simple_pte *curPte, uint8_t lvl) -> bool {
-    return exists(curPte);
-  };
-  auto beforeRecursiveCall = [](simple_pte *curPte, uint8_t lvl) {
-    printf("Before Recursion\n");
-  };
-  auto afterRecursiveCall = [](simple_pte *childPte, simple_pte *curPte, uint8_t lvl) {
-    printf("After Recursion\n");
-  };
-  auto leaf = [](simple_pte *curPte, uint8_t lvl) {
-    printf("At leaf\n");
-  };
-  auto beforeReturn = [](simple_pte *root, uint8_t lvl) {
-    printf("About to return\n");
-  };
-
-  // TODO(tommyu): fn suffix.
-  traversePageTable(root, lvl,
-                    predicate,
-                    beforeRecursiveCall,
-                    afterRecursiveCall,
-                    leaf,
-                    beforeReturn
-                    );
-}
-
-// void UmPgTblMgmt::traverseWriteablePages(simple_pte *root, uint8_t lvl, leafFn L) {
-//   auto pred = [](simple_pte *curPte, uint8_t lvl) -> bool {
-//     // exists() is redundant assuming non existant ptes are 0.
-//     return exists(curPte) && isAccessed(curPte) && isWritable(curPte);
-//   };
 
-//   traversePageTable(root, lvl, pred, nullBRFn, nullARFn, L, nullBRetFn);
-// }
-
-void UmPgTblMgmt::traverseAccessedPages(simple_pte *root, uint8_t lvl, leafFn L) {
-  auto pred = [](simple_pte *curPte, uint8_t lvl) -> bool {
-    // exists() is redundant assuming non existant ptes are 0.
-    return exists(curPte) && isAccessed(curPte);
+void UmPgTblMgmt::collectAccessedPrivatePages(std::vector<uintptr_t> &pages,
+                                              simple_pte *root, uint8_t lvl) {
+  auto leafFn = [&pages](simple_pte *curPte, lin_addr virt, uint8_t lvl) {
+    // Read only & dirty is a reference into a snapshot, never faulted.
+    if (isWritable(curPte) || !isDirty(curPte))
+      pages.push_back(virt.raw);
   };
-
-  traversePageTable(root, lvl, pred, nullBRFn, nullARFn, L, nullBRetFn);
-}
-
-void UmPgTblMgmt::traverseAccessedPages(simple_pte *root, uint8_t lvl, leafFn L, beforeRetFn BRET) {
-  auto pred = [](simple_pte *curPte, uint8_t lvl) -> bool {
-    // exists() is redundant assuming non existant ptes are 0.
-    return exists(curPte) && isAccessed(curPte);
-  };
-
-  traversePageTable(root, lvl, pred, nullBRFn, nullARFn, L, BRET);
-}
-
-void UmPgTblMgmt::traverseValidPages(simple_pte *root, uint8_t lvl, leafFn L) {
-  traverseValidPages(root, lvl, nullBRFn, nullARFn, L, nullBRetFn);
-}
-
-void UmPgTblMgmt::traverseValidPages(simple_pte *root, uint8_t lvl,
-                                     beforeRecFn BR, afterRecFn AR, leafFn L, beforeRetFn BRET) {
-  auto pred = [](simple_pte *curPte, uint8_t lvl) -> bool {
-    return exists(curPte);
+  walkPgTblLeaves<PTE_P | PTE_A, 0>(root, lvl, slotWalkBase(lvl), notSharedFn,
+                                    leafFn);
+}
+
+size_t UmPgTblMgmt::sampleAccessedPages(simple_pte *root, uint8_t lvl,
+                                        InvalidationTracker &inv) {
+  size_t n = 0;
+  auto leafFn = [&n, &inv](simple_pte *curPte, lin_addr virt, uint8_t lvl) {
+    n += pgBytes[lvl] >> SMALL_PG_SHIFT;
+    curPte->decompCommon.A = 0;
+    // A cached translation wouldn't set it again.
+    inv.Record(virt);
   };
-  traversePageTable(root, lvl, pred, BR, AR, L, BRET);
+  walkPgTblLeaves<PTE_P, PTE_A>(root, lvl, slotWalkBase(lvl), notSharedFn,
+                                leafFn);
+  return n;
 }
 
-// Continue predicate, before recursion, after recursion, leaf, before return.
-simple_pte *UmPgTblMgmt::traversePageTable(simple_pte *root, uint8_t lvl,
-                                           predicateFn P, beforeRecFn BR, afterRecFn AR,
-                                           leafFn L, beforeRetFn BRET) {
-  // A general page table traverser. Intention is not to call this directly
-  // from client code, but to make specializations, like a fn that only walks
-  // valid pages, accessed pages, dirty pages ...
-  for (int i = 0; i < 512; i++) { // Loop over all entries in table.
-    simple_pte *curPte = root + i;
-
-    if (!P(curPte, lvl)) // ! allows pred to stay in positive sense for caller.
-      continue;
-
-    if (isLeaf(curPte, lvl)) { // -> a physical page of some sz.
-      L(curPte, lvl);
-
-    } else { // This entry points to a sub page table.
-      BR(curPte, lvl);
-      simple_pte *childRoot = traversePageTable(nextTableOrFrame(root, i, lvl), lvl - 1, P, BR, AR, L, BRET);
-      // NOTE: This guy takes an extra arg.
-      AR(childRoot, curPte, lvl);
-    }
-  }
-  // NOTE: This guy takes root, not curPte!
-  BRET(root, lvl);
-  return root;
+void UmPgTblMgmt::printTraversalLamb(simple_pte *root, uint8_t lvl) {
+  // Dummy example for how one might use the walker's hooks.
+  PrintVisitor v;
+  walkPgTbl(root, lvl, 0, v);
 }
 
 #if 0
@@ -272,6 +395,41 @@ lin_addr UmPgTblMgmt::getPhysAddrLamb(lin_addr la, simple_pte* root, unsigned ch
   return ret;
 }
 
+simple_pte *UmPgTblMgmt::findLeafPTE(simple_pte *root, uint8_t lvl,
+                                      lin_addr virt, uint8_t *leafLvl) {
+  // Unlike walkPageTable, safe to call on addresses that aren't mapped.
+  while (root != nullptr && lvl >= TBL_LEVEL) {
+    simple_pte *curPte = root + virt[lvl];
+    if (!exists(curPte))
+      return nullptr;
+    if (isLeaf(curPte, lvl)) {
+      if (leafLvl != nullptr)
+        *leafLvl = lvl;
+      return curPte;
+    }
+    root = nextTableOrFrame(root, virt[lvl], lvl);
+    lvl--;
+  }
+  return nullptr;
+}
+
+simple_pte *UmPgTblMgmt::findPTE(simple_pte *root, uint8_t lvl,
+                                  lin_addr virt, uint8_t stopLvl) {
+  kassert(stopLvl >= TBL_LEVEL && stopLvl <= lvl);
+  while (root != nullptr) {
+    simple_pte *curPte = root + virt[lvl];
+    if (lvl == stopLvl)
+      return curPte;
+    if (!exists(curPte))
+      return nullptr;
+    if (isLeaf(curPte, lvl))
+      return curPte;
+    root = nextTableOrFrame(root, virt[lvl], lvl);
+    lvl--;
+  }
+  return nullptr;
+}
+
 simple_pte *UmPgTblMgmt::addrToPTELamb(lin_addr la, simple_pte* root, unsigned char lvl) {
   simple_pte *pte;
 
@@ -303,9 +461,11 @@ void UmPgTblMgmt::dumpAllPTEsWalkLamb(lin_addr la, simple_pte* root,
 void UmPgTblMgmt::setUserAllPTEsWalkLamb(lin_addr la, simple_pte* root,
                                       unsigned char lvl) {
   printf("In %s\n", __func__);
-  auto recFn = [](simple_pte *curPte, lin_addr virt, uint8_t lvl) -> void{
+  InvalidationTracker inv;
+  auto recFn = [&inv](simple_pte *curPte, lin_addr virt, uint8_t lvl) -> void{
     // Set user bit.
     curPte->raw = curPte->raw | 1 << 2;
+    inv.Record(virt);
   };
 
   auto leafFn = [](simple_pte *curPte, lin_addr virt, uint8_t lvl) -> uintptr_t{
@@ -313,35 +473,8 @@ void UmPgTblMgmt::setUserAllPTEsWalkLamb(lin_addr la, simple_pte* root,
   };
 
   walkPageTable(root, lvl, la, recFn, leafFn);
-  // HACK: Super overkill, but being overly conservative.
-  flushTranslationCaches();
-}
-
-uintptr_t UmPgTblMgmt::walkPageTable(simple_pte *root, uint8_t lvl,
-                                     lin_addr virt, walkLeafFn L) {
-  // Given a virtual address, walk down to mapping level. Assume can be used,
-  // for example, by a mapper to inject an address at a given level, or by a
-  // query for the physical frame mapped by a particular address.
-
-  // Before doing anything, maybe nothing, maybe check if root is nullptr.
-
-  simple_pte *curPTE = root + virt[lvl];
-
-  if(isLeaf(curPTE, lvl)){
-    return L(curPTE, virt, lvl);
-  }
-  // printf("We exist, but we're not a leaf, recurse!\n");
-  return walkPageTable(nextTableOrFrame(root, virt[lvl], lvl), lvl-1, virt, L);
-}
-
-uintptr_t UmPgTblMgmt::walkPageTable(simple_pte *root, uint8_t lvl,
-                                     lin_addr virt, walkRecFn R, walkLeafFn L) {
-  simple_pte *curPTE = root + virt[lvl];
-  R(curPTE, virt, lvl);
-  if(isLeaf(curPTE, lvl)){
-    return L(curPTE, virt, lvl);
-  }
-  return walkPageTable(nextTableOrFrame(root, virt[lvl], lvl), lvl-1, virt, R, L);
+  // Only the path to la changed.
+  inv.Commit();
 }
 
 // Printer helper.
@@ -443,24 +576,6 @@ void UmPgTblMgmt::dumpTableAddrs(simple_pte *root, unsigned char lvl){
   }
 }
 
-void UmPgTblMgmt::countDirtyPagesHelper(std::vector<uint64_t> &counts,
-                                        simple_pte *root, uint8_t lvl) {
-  for (int i = 0; i < 512; i++) {
-    if (!exists(root + i)) {
-      continue;
-    }
-    if (isLeaf(root + i, lvl)) {
-      // printf("Found a leaf at level %d\n", lvl);
-      // printf("%d >\n", i);
-      if (isDirty(root + i)) {
-        counts[lvl]++;
-      }
-    } else {
-      countDirtyPagesHelper(counts, nextTableOrFrame(root, i, lvl), lvl - 1);
-    }
-  }
-}
-
 void UmPgTblMgmt::countDirtyPages(std::vector<uint64_t> &counts, simple_pte *root, uint8_t lvl) {
   // Going to grab PML4, so better be lvl 4.
   if(root == nullptr){
@@ -471,23 +586,7 @@ void UmPgTblMgmt::countDirtyPages(std::vector<uint64_t> &counts, simple_pte *roo
     root = getPML4Root();
   }
   kassert(counts.size() == 5);
-  countDirtyPagesHelper(counts, root, lvl);
-}
-
-void UmPgTblMgmt::countAccessedPagesHelper(std::vector<uint64_t> &counts,
-                                           simple_pte *root, uint8_t lvl) {
-  // Counts accessed leaf pages at various levels.
-  for (int i = 0; i < 512; i++) {
-    if (!exists(root + i))
-      continue;
-    if (isLeaf(root + i, lvl)) {
-      if (isAccessed(root + i)) {
-        counts[lvl]++;
-      }
-    } else {
-      countAccessedPagesHelper(counts, nextTableOrFrame(root, i, lvl), lvl - 1);
-    }
-  }
+  walkPgTblLeaves<PTE_P, PTE_D>(root, lvl, 0, anyFn, CountLeaves(counts));
 }
 
 void UmPgTblMgmt::countAccessedPages(std::vector<uint64_t> &counts, simple_pte *root, uint8_t lvl) {
@@ -500,7 +599,8 @@ void UmPgTblMgmt::countAccessedPages(std::vector<uint64_t> &counts, simple_pte *
     root = getPML4Root();
   }
   kassert(counts.size() == 5);
-  countAccessedPagesHelper(counts, root, lvl);
+  // Counts accessed leaf pages at various levels.
+  walkPgTblLeaves<PTE_P, PTE_A>(root, lvl, 0, anyFn, CountLeaves(counts));
 }
 
 void UmPgTblMgmt::countValidPTEsHelper(std::vector<uint64_t> &counts,
@@ -529,20 +629,6 @@ void UmPgTblMgmt::countValidPTEs(std::vector<uint64_t> &counts, simple_pte *root
   countValidPTEsHelper(counts, root, lvl);
 }
 
-void UmPgTblMgmt::countValidPagesHelper(std::vector<uint64_t> &counts,
-                                        simple_pte *root, uint8_t lvl) {
-  // Counts valid leaf pages at various levels.
-  for (int i = 0; i < 512; i++) {
-    if (!exists(root + i))
-      continue;
-    if (isLeaf(root + i, lvl)) {
-      counts[lvl]++;
-    } else {
-      countValidPagesHelper(counts, nextTableOrFrame(root, i, lvl), lvl - 1);
-    }
-  }
-}
-
 void UmPgTblMgmt::countValidPages(std::vector<uint64_t> &counts, simple_pte *root, uint8_t lvl) {
   // Going to grab PML4, so better be lvl 4.
   if(root == nullptr){
@@ -553,7 +639,7 @@ void UmPgTblMgmt::countValidPages(std::vector<uint64_t> &counts, simple_pte *roo
     root = getPML4Root();
   }
   kassert(counts.size() == 5);
-  countValidPagesHelper(counts, root, lvl);
+  countValidPagesLamb(counts, root, lvl);
 }
 
 uintptr_t UmPgTblMgmt::injectOffset(lin_addr la, unsigned char lvl){
@@ -788,6 +874,62 @@ void UmPgTblMgmt::flushTranslationCaches(){
   // TODO: Theoretically redundant.
 }
 
+bool UmPgTblMgmt::enablePCID(){
+  if (!x86_64::PCIDSupported())
+    return false;
+
+  x86_64::CR4 cr4;
+  cr4.get();
+  if (cr4.PCIDE)
+    return true;
+
+  // Requires cr3[11:0] == 0, we're running under PCID 0.
+  x86_64::CR3 cr3;
+  cr3.get();
+  kassert(cr3.PCID == 0);
+  cr4.PCIDE = 1;
+  cr4.set();
+  return true;
+}
+
+void UmPgTblMgmt::InvalidationTracker::Record(lin_addr la, bool leaf){
+  if (full_)
+    return;
+  // A table may back a TLB entry per page beneath it.
+  if (!leaf || n_ == UMM_INVLPG_MAX) {
+    full_ = true;
+    return;
+  }
+  // Walkers record every level on the way to a page.
+  if (n_ && pages_[n_ - 1].raw == la.raw)
+    return;
+  pages_[n_++] = la;
+}
+
+void UmPgTblMgmt::InvalidationTracker::Commit(){
+  // invlpg also drops every cached walk of the current PCID.
+  if (full_) {
+    flushTranslationCaches();
+  } else {
+    for (size_t i = 0; i < n_; i++)
+      invlpg((void *)pages_[i].raw);
+  }
+  n_ = 0;
+  full_ = false;
+}
+
+void UmPgTblMgmt::loadPCID(uint16_t pcid, bool flush, simple_pte *pml4){
+  // Only the translations tagged with pcid are dropped on flush, the rest of
+  // the TLB is left alone.
+  x86_64::CR3 cr3;
+  cr3.get();
+  if (pml4 != nullptr)
+    cr3.PG_TBL_ADDR = (uint64_t)pml4 >> SMALL_PG_SHIFT;
+  cr3.PCID = pcid;
+  cr3.NOFLUSH = flush ? 0 : 1;
+  cr3.set();
+}
+
 bool UmPgTblMgmt::exists(simple_pte *pte){
   if(pte->decompCommon.SEL == 1)
     return true;
@@ -822,6 +964,20 @@ bool UmPgTblMgmt::isAccessed(simple_pte *pte){
   return false;
 }
 
+bool UmPgTblMgmt::isShared(simple_pte *pte){
+  if(pte->decompCommon.WHOCARES2 & SHARED_AVL_BIT){
+    return true;
+  }
+  return false;
+}
+
+bool UmPgTblMgmt::isCold(simple_pte *pte){
+  if(!exists(pte) && (pte->decompCommon.WHOCARES2 & COLD_AVL_BIT)){
+    return true;
+  }
+  return false;
+}
+
 bool UmPgTblMgmt::isLeaf(simple_pte *pte, unsigned char lvl){
   if(lvl == TBL_LEVEL){
     return true;
@@ -836,61 +992,128 @@ bool UmPgTblMgmt::isLeaf(simple_pte *pte, unsigned char lvl){
 }
 
 simple_pte * UmPgTblMgmt::walkPgTblCOW(simple_pte *root, simple_pte *copy, uint8_t lvl) {
-  // Entry 0 is bogus and unused
-  // HACK(tommyu): trying to get off the ground.
-  uint64_t idx[5] = {0};
-  // HACK(tommyu): This is actually critical.
-  idx[4] = SLOT_PML4_NUM;
-  // kprintf(CYAN "COW pg tbl copy\n" RESET);
-  return walkPgTblCOWHelper(root, copy, lvl, idx);
+  COWVisitor v(copy);
+  walkPgTbl(root, lvl, slotWalkBase(lvl), v);
+  return v.copy;
 }
 
 simple_pte * UmPgTblMgmt::walkPgTblCopyDirtyCOW(simple_pte *root, simple_pte *copy, uint8_t lvl) {
-  // Entry 0 is bogus and unused
-  // HACK(tommyu): trying to get off the ground.
-  uint64_t idx[5] = {0};
-  // HACK(tommyu): This is actually critical.
-  idx[4] = SLOT_PML4_NUM;
-  // kprintf(RED "Snapshot COW\n" RESET);
-  return walkPgTblCopyDirtyCOWHelper(root, copy, lvl, idx);
+  CopyDirtyCOWVisitor v(copy);
+  walkPgTbl(root, lvl, slotWalkBase(lvl), v);
+  return v.copy;
+}
+
+simple_pte * UmPgTblMgmt::walkPgTblCopyDirtyCOW(simple_pte *root, simple_pte *copy, uint8_t lvl,
+                                                std::vector<CopyUnit> &units) {
+  SplitVisitor<CopyDirtyCOWVisitor> v(copy, units);
+  walkPgTbl(root, lvl, slotWalkBase(lvl), v);
+  return v.copy;
+}
+
+simple_pte * UmPgTblMgmt::walkPgTblLazyCOW(simple_pte *root, simple_pte *copy, uint8_t lvl,
+                                           InvalidationTracker &inv) {
+  LazyCOWVisitor v(copy, inv);
+  walkPgTbl(root, lvl, slotWalkBase(lvl), v);
+  return v.copy;
+}
+
+void UmPgTblMgmt::copyUnit(CopyUnit &u) {
+  CopyDirtyCOWVisitor v(nullptr, TBL_LEVEL);
+  walkPgTbl(u.src, TBL_LEVEL, u.virt.raw, v);
+  u.copy = v.copy;
+}
+
+simple_pte * UmPgTblMgmt::linkUnits(simple_pte *copy, uint8_t lvl,
+                                    const std::vector<CopyUnit> &units) {
+  kassert(lvl > DIR_LEVEL);
+  for (const auto &u : units) {
+    if (u.copy == nullptr)
+      continue;
+    if (copy == nullptr)
+      copy = (simple_pte *)pg_magazine->AllocZero(UmPgMagazine::table).ToAddr();
+    // Walk down to the directory, creating what the split walk didn't.
+    simple_pte *tbl = copy;
+    lin_addr virt = u.virt;
+    for (uint8_t l = lvl; l > DIR_LEVEL; l--) {
+      simple_pte *pte = tbl + virt[l];
+      if (!exists(pte)) {
+        auto page = pg_magazine->AllocZero(UmPgMagazine::table);
+        pte->setPte((simple_pte *)page.ToAddr(), false, true, true, true);
+      }
+      kassert(!isLeaf(pte, l) && !isShared(pte));
+      tbl = nextTableOrFrame(pte, 0, l);
+    }
+    simple_pte *pde = tbl + virt[DIR_LEVEL];
+    kassert(!exists(pde));
+    // The unit's reference to its table moves into the entry.
+    pde->setPte(u.copy, false, true, true, true);
+  }
+  return copy;
 }
 
 simple_pte * UmPgTblMgmt::walkPgTblCopyDirty(simple_pte *root, simple_pte *copy, uint8_t lvl) {
-  // Entry 0 is bogus and unused
-  // HACK(tommyu): trying to get off the ground.
-  uint64_t idx[5] = {0};
-  // HACK(tommyu): This is actually critical.
-  idx[4] = SLOT_PML4_NUM;
   kprintf(MAGENTA "Deep pg tbl copy\n" RESET);
-  return walkPgTblCopyDirtyHelper(root, copy, lvl, idx);
+  CopyDirtyVisitor v(copy);
+  walkPgTbl(root, lvl, slotWalkBase(lvl), v);
+  return v.copy;
 }
 
-simple_pte * UmPgTblMgmt::walkPgTblCopyDirty(simple_pte *root, simple_pte *copy) {
-  // Entry 0 is bogus and unused
-
-  // HACK(tommyu): trying to get off the ground.
-  uint64_t idx[5] = {0};
+simple_pte * UmPgTblMgmt::walkPgTblCopyDelta(simple_pte *root, simple_pte *copy, uint8_t lvl) {
+  CopyDeltaVisitor v(copy);
+  walkPgTbl(root, lvl, slotWalkBase(lvl), v);
+  return v.copy;
+}
 
+simple_pte * UmPgTblMgmt::walkPgTblCopyDirty(simple_pte *root, simple_pte *copy) {
   if (root == nullptr){
     root = getSlotPDPTRoot();
   }
-  unsigned char lvl = 3;
+  CopyDirtyVisitor v(copy);
+  walkPgTbl(root, PDPT_LEVEL, kSlotWalkBase, v);
+  return v.copy;
+}
 
-  // HACK(tommyu): This is actually critical.
-  idx[4] = SLOT_PML4_NUM;
+simple_pte * UmPgTblMgmt::shareTable(simple_pte *root, uint8_t lvl) {
+  // O(1) clone of a table. Leaves become COW references and subtrees are
+  // pointed at in place, RW clear at the entry protects the whole subtree.
+  // Both tables now reference every child.
+  auto page = pg_magazine->Alloc(UmPgMagazine::table);
+  simple_pte *copy = (simple_pte *)page.ToAddr();
+  memcpy((void *)copy, (void *)root, pgBytes[TBL_LEVEL]);
 
-  simple_pte *ret = walkPgTblCopyDirtyHelper(root, copy, lvl, idx);
+  for (int i = 0; i < 512; i++) {
+    if (!exists(copy + i))
+      continue;
+    (copy + i)->decompCommon.RW = 0;
+    if (!isLeaf(copy + i, lvl))
+      (copy + i)->decompCommon.WHOCARES2 |= SHARED_AVL_BIT;
+    FrameRef::Get((copy + i)->pageTabEntToAddr(lvl).raw);
+  }
+  return copy;
+}
 
-  return ret;
+void UmPgTblMgmt::unshareTable(simple_pte *pte, uint8_t lvl) {
+  kassert(isShared(pte) && !isLeaf(pte, lvl));
+  simple_pte *shared = nextTableOrFrame(pte, 0, lvl);
+  simple_pte *copy = shareTable(shared, lvl - 1);
+
+  // Entry now owns its table, keep the remaining permission bits.
+  pte->decompCommon.PG_TBL_ADDR = (uint64_t)copy >> SMALL_PG_SHIFT;
+  pte->decompCommon.WHOCARES2 &= ~SHARED_AVL_BIT;
+  pte->decompCommon.RW = 1;
+  // The other holders may be gone, then the old table goes with our ref.
+  freePageTableLamb(shared, lvl - 1);
 }
 
-lin_addr UmPgTblMgmt::reconstructLinAddrPgFromOffsets(uint64_t *idx){
+lin_addr UmPgTblMgmt::reconstructLinAddrPgFromOffsets(uint64_t *idx,
+                                                      unsigned char lvl) {
   lin_addr la;
   la.raw = 0;
   la.tblOffsets.PML4 = idx[PML4_LEVEL];
   la.tblOffsets.PDPT = idx[PDPT_LEVEL];
-  la.tblOffsets.DIR = idx[DIR_LEVEL];
-  la.tblOffsets.TAB = idx[TBL_LEVEL];
+  // Offsets below a large page leaf are stale from earlier iterations.
+  la.tblOffsets.DIR = (lvl <= DIR_LEVEL) ? idx[DIR_LEVEL] : 0;
+  la.tblOffsets.TAB = (lvl <= TBL_LEVEL) ? idx[TBL_LEVEL] : 0;
 
   // HACK(tommyu): Something about cannonical addressing? Need to do some reading.
   // Think this should only be applied if pml4 num >= 256 aka 0x100, half 512, 0x200.
@@ -900,12 +1123,13 @@ lin_addr UmPgTblMgmt::reconstructLinAddrPgFromOffsets(uint64_t *idx){
 }
 
 lin_addr UmPgTblMgmt::copyDirtyPage(lin_addr src, unsigned char lvl){
-  auto page = ebbrt::page_allocator->Alloc();
+  auto page = pg_magazine->Alloc(UmPgMagazine::data, orders[lvl]);
   // if(page == Pfn::None())
   //   kprintf_force(RED "Ran out of pages\n" RESET);
   kbugon(page == Pfn::None());
   auto page_addr = page.ToAddr();
-  memcpy((void*)page_addr, (void*)src.raw, 1UL << pgShifts[lvl]);
+  // Snapshot pages are only read again by a later clone's faults.
+  PgCopy::Stream((void*)page_addr, (void*)src.raw, 1UL << pgShifts[lvl]);
   lin_addr la;
   la.raw = (uint64_t) page_addr;
   return la;
@@ -958,15 +1182,17 @@ void simple_pte::setPte(simple_pte *tab,
 
 simple_pte *UmPgTblMgmt::mapIntoPgTbl(simple_pte *root, lin_addr phys, lin_addr virt,
                                       unsigned char rootLvl, unsigned char mapLvl, unsigned char curLvl,
-                                      bool writeFault, bool rdPerm, bool execDisable) {
+                                      bool writeFault, bool rdPerm, bool execDisable,
+                                      bool accessed, InvalidationTracker *inv) {
   return mapIntoPgTblHelper(root, phys, virt,
                             rootLvl, mapLvl, curLvl,
-                            writeFault, rdPerm, execDisable);
+                            writeFault, rdPerm, execDisable, accessed, inv);
 }
 
 simple_pte *UmPgTblMgmt::mapIntoPgTblHelper(simple_pte *root, lin_addr phys, lin_addr virt,
                                             unsigned char rootLvl, unsigned char mapLvl, unsigned char curLvl,
-                                            bool writeFault, bool rdPerm, bool execDisable) {
+                                            bool writeFault, bool rdPerm, bool execDisable,
+                                            bool accessed, InvalidationTracker *inv) {
   kassert(rootLvl >= mapLvl);
   kassert(rootLvl >= curLvl);
   kassert(rootLvl <= PML4_LEVEL && rootLvl >= TBL_LEVEL);
@@ -974,11 +1200,8 @@ simple_pte *UmPgTblMgmt::mapIntoPgTblHelper(simple_pte *root, lin_addr phys, lin
 
   // No pg table here, need to allocate.
   if (root == nullptr) {
-    auto page = ebbrt::page_allocator->Alloc();
-    kbugon(page == Pfn::None());
-    auto page_addr = page.ToAddr();
-    memset((void *)page_addr, 0, pgBytes[TBL_LEVEL]);
-    root = (simple_pte *)page_addr;
+    auto page = pg_magazine->AllocZero(UmPgMagazine::table);
+    root = (simple_pte *)page.ToAddr();
   }
 
   // Get offset using custom indexing operator.
@@ -991,19 +1214,34 @@ simple_pte *UmPgTblMgmt::mapIntoPgTblHelper(simple_pte *root, lin_addr phys, lin
     // Mark mapping PTE user.
     // If write, mark dirty and R/W. Otherwise not dirty, read only.
     // pte_ptr->setPte((simple_pte *)phys.raw, writeFault, true, true, true);
-    pte_ptr->setPte((simple_pte *)phys.raw, writeFault, true, rdPerm, true, execDisable);
+    // The caller's reference to phys moves into the entry, a COW fault drops
+    // the one to the page it replaces.
+    if (exists(pte_ptr))
+      putFrame(pte_ptr->pageTabEntToAddr(mapLvl).raw, mapLvl);
+    // Leaves mapped ahead of use start unaccessed, hardware tells if they hit.
+    pte_ptr->setPte((simple_pte *)phys.raw, writeFault, accessed, rdPerm, true, execDisable);
+    // Large page leaf.
+    if (mapLvl > TBL_LEVEL)
+      pte_ptr->decompCommon.MAPS = 1;
   } else {
     if (exists(pte_ptr)) {
+      // Copy a snapshot's table before writing under it. Pages below still
+      // map the same frames read only, only the cached walk to virt is stale.
+      if (isShared(pte_ptr)) {
+        unshareTable(pte_ptr, curLvl);
+        if (inv)
+          inv->Record(virt);
+      }
       // Recurse to next level
       mapIntoPgTbl(nextTableOrFrame(pte_ptr, 0, curLvl), phys, virt,
                    rootLvl, mapLvl, curLvl - 1,
-                   writeFault, rdPerm, execDisable);
+                   writeFault, rdPerm, execDisable, accessed, inv);
     } else {
       // Create next level and recurse.
       simple_pte *ret =
         mapIntoPgTbl(nullptr, phys, virt,
                      rootLvl, mapLvl, curLvl - 1,
-                     writeFault, rdPerm, execDisable);
+                     writeFault, rdPerm, execDisable, accessed, inv);
       // Dirty bit doesn't apply, accessed does.
       // Mark interior PTEs user.
       pte_ptr->setPte(ret, false, true, true, true);
@@ -1024,12 +1262,9 @@ simple_pte *UmPgTblMgmt::findAndSetPTECOW(simple_pte *root, simple_pte *origPte,
 
   // No pg table here, need to allocate.
   if (root == nullptr) {
-    auto page = ebbrt::page_allocator->Alloc();
-    kbugon(page == Pfn::None());
-    auto page_addr = page.ToAddr();
     // Set all invalid.
-    memset((void *)page_addr, 0, pgBytes[TBL_LEVEL]);
-    root = (simple_pte *)page_addr;
+    auto page = pg_magazine->AllocZero(UmPgMagazine::table);
+    root = (simple_pte *)page.ToAddr();
   }
 
   // Get offset using custom indexing operator.
@@ -1039,7 +1274,10 @@ simple_pte *UmPgTblMgmt::findAndSetPTECOW(simple_pte *root, simple_pte *origPte,
     // We're in the table, modify the entry & importantly mark it dirty.
     // TODO: Should this always be marked accessed? Def in copy dirty.
     // NOTE: Setting read only access.
-    pte_ptr->setPte((simple_pte *) origPte->pageTabEntToAddr(TBL_LEVEL).raw, true, true, false, true); // TODO
+    pte_ptr->setPte((simple_pte *) origPte->pageTabEntToAddr(mapLvl).raw, true, true, false, true); // TODO
+    FrameRef::Get(pte_ptr->pageTabEntToAddr(mapLvl).raw);
+    if (mapLvl > TBL_LEVEL)
+      pte_ptr->decompCommon.MAPS = 1;
   } else {
     if (exists(pte_ptr)) {
       findAndSetPTECOW(nextTableOrFrame(pte_ptr, 0, curLvl), origPte, virt, rootLvl, mapLvl, curLvl - 1);
@@ -1053,139 +1291,37 @@ simple_pte *UmPgTblMgmt::findAndSetPTECOW(simple_pte *root, simple_pte *origPte,
   return root;
 }
 
-simple_pte *UmPgTblMgmt::walkPgTblCopyDirtyHelper(simple_pte *root,
-                                                 simple_pte *copy,
-                                                 unsigned char lvl,
-                                                 uint64_t *idx) {
-  // HACK(tommyu): This is a dirty hack to reconstruct the linear addr that got
-  // you to this dirty page. I think we can do better.
-  // Scan all 512 entries, if predicate holds, recurse.
-  for (int i = 0; i < 512; i++) {
-    if (!exists(root + i))
-      continue;
-    idx[lvl] = i;
-
-    if (isLeaf(root + i, lvl)) {
-      // Higher NYI
-      kassert(lvl == 1);
-      if ((root + i)->decompCommon.DIRTY) {
-        // Allocate new page and make copy.
-        lin_addr backing;
-        backing.raw = (root + i)->pageTabEntToAddr(lvl).raw;
-        // Copy onto new page.
-        lin_addr phys = copyDirtyPage(backing, lvl);
-
-        // TODO(tommyu) is there a better way?
-        // Reconstruct page Lin Addr.
-        lin_addr virt = reconstructLinAddrPgFromOffsets(idx);
-
-        copy = mapIntoPgTbl(copy, phys, virt, PDPT_LEVEL, lvl, PDPT_LEVEL, true);
-      }
-    } else {
-      // Don't alter your own root, or you will break on the next goaround.
-      copy = walkPgTblCopyDirtyHelper(nextTableOrFrame(root, i, lvl),
-                                      copy, lvl - 1, idx);
-    }
-  }
-  return copy;
-}
+simple_pte *UmPgTblMgmt::findAndSetPTE(simple_pte *root, simple_pte *origPte,
+                                        lin_addr virt, unsigned char rootLvl,
+                                        unsigned char mapLvl,
+                                        unsigned char curLvl) {
+  kassert(rootLvl >= mapLvl);
+  kassert(rootLvl >= curLvl);
+  kassert(rootLvl <= PML4_LEVEL && rootLvl >= TBL_LEVEL);
 
-simple_pte *UmPgTblMgmt::walkPgTblCopyDirtyCOWHelper(simple_pte *root,
-                                                 simple_pte *copy,
-                                                 unsigned char lvl,
-                                                 uint64_t *idx) {
-  // HACK(tommyu): This is a dirty hack to reconstruct the linear addr that got
-  // you to this dirty page. I think we can do better.
-  // Scan all 512 entries, if predicate holds, recurse.
-  for (int i = 0; i < 512; i++) {
-    if (!exists(root + i))
-      continue;
-    idx[lvl] = i;
-
-    if (isLeaf(root + i, lvl)) {
-      // Higher NYI
-      kassert(lvl == 1);
-      if ((root + i)->decompCommon.DIRTY ) {
-        // TODO(tommyu) is there a better way?
-        // Reconstruct page Lin Addr.
-        lin_addr virt = reconstructLinAddrPgFromOffsets(idx);
-        if ((root + i)->decompCommon.RW == 1) {
-          // This page was faulted in during the running of this instance, need
-          // deep copy.
-          // Allocate new page and make copy.
-          lin_addr backing;
-          backing.raw = (root + i)->pageTabEntToAddr(lvl).raw;
-          // Copy onto new page.
-          lin_addr phys = copyDirtyPage(backing, lvl);
-
-          // umm::manager->num_cp_pgs++;
-
-          // Super useful
-          // kprintf_force(GREEN "C" RESET);
-
-          copy =
-              mapIntoPgTbl(copy, phys, virt, PDPT_LEVEL, lvl, PDPT_LEVEL, true);
-        } else {
-          // This is just a pointer to a page that exists in a previous
-          // snapshot. Just create a pointer here.
-          // copy =
-          //   mapIntoPgTbl(copy, phys, virt, PDPT_LEVEL, lvl, PDPT_LEVEL, true);
-          simple_pte *thisPte = root + i;
-          copy = findAndSetPTECOW(copy, thisPte, virt, PDPT_LEVEL, lvl, PDPT_LEVEL);
-        }
-      }
-    } else {
-      // Don't alter your own root, or you will break on the next goaround.
-      copy = walkPgTblCopyDirtyCOWHelper(nextTableOrFrame(root, i, lvl),
-                                      copy, lvl - 1, idx);
-    }
+  if (root == nullptr) {
+    auto page = pg_magazine->AllocZero(UmPgMagazine::table);
+    root = (simple_pte *)page.ToAddr();
   }
-  return copy;
-}
-
-simple_pte *UmPgTblMgmt::walkPgTblCOWHelper(simple_pte *root,
-                                                 simple_pte *copy,
-                                                 unsigned char lvl,
-                                                 uint64_t *idx) {
-  // HACK(tommyu): This is a dirty hack to reconstruct the linear addr that got
-  // you to this dirty page. I think we can do better.
-  // Scan all 512 entries, if predicate holds, recurse.
-  for (int i = 0; i < 512; i++) {
-    if (!exists(root + i))
-      continue;
-    idx[lvl] = i;
-
-    if (isLeaf(root + i, lvl)) {
-      // Higher NYI
-      kassert(lvl == 1);
-      if ((root + i)->decompCommon.DIRTY) {
-        // TODO: I think we can do this for all pages, not just dirty.
 
-        // Allocate new page and make copy.
-        // lin_addr backing;
-        // backing.raw = (root + i)->pageTabEntToAddr(lvl).raw;
-        // Copy onto new page.
-        // lin_addr phys = copyDirtyPage(backing, lvl);
-
-        // TODO(tommyu) is there a better way?
-        // Reconstruct page Lin Addr.
-        lin_addr virt = reconstructLinAddrPgFromOffsets(idx);
-
-        // Super useful
-        // kprintf_force(GREEN "C" RESET);
-
-        // copy = mapIntoPgTbl(copy, phys, virt, PDPT_LEVEL, lvl, PDPT_LEVEL);
-        simple_pte *thisPte = root + i;
-        copy = findAndSetPTECOW(copy, thisPte, virt, PDPT_LEVEL, lvl, PDPT_LEVEL);
-
-      }
+  simple_pte *pte_ptr = root + virt[curLvl];
+  if (curLvl == mapLvl) {
+    pte_ptr->raw = origPte->raw;
+    // Cold markers hold a blob id, not a frame.
+    if (exists(pte_ptr))
+      FrameRef::Get(pte_ptr->pageTabEntToAddr(mapLvl).raw);
+  } else {
+    if (exists(pte_ptr)) {
+      kassert(!isShared(pte_ptr));
+      findAndSetPTE(nextTableOrFrame(pte_ptr, 0, curLvl), origPte, virt,
+                    rootLvl, mapLvl, curLvl - 1);
     } else {
-      // Don't alter your own root, or you will break on the next goaround.
-      copy = walkPgTblCOWHelper(nextTableOrFrame(root, i, lvl),
-                                      copy, lvl - 1, idx);
+      simple_pte *ret =
+        findAndSetPTE(nullptr, origPte, virt, rootLvl, mapLvl, curLvl - 1);
+      pte_ptr->setPte(ret, false, true, true, true);
     }
   }
-  return copy;
+  return root;
 }
 
 #if 0
@@ -6,7 +6,7 @@
 #define UMM_UM_PG_TBL_MGR
 
 #include "stdint.h"
-#include <functional>
+#include <cstddef>
 #include <vector>
 
 #define SMALL_PG_SHIFT 12
@@ -28,6 +28,17 @@ extern const char* level_names[];
 // Magic PML4 entry chosen for slot.
 #define SLOT_PML4_NUM 0x180
 
+// Ignored bit 9 of a table entry, marks a subtree shared read only with a
+// snapshot. Such tables are copied before anything under them changes.
+#define SHARED_AVL_BIT 0x2
+
+// Ignored bit 11 of a non present leaf, the page is compressed in UmColdStore
+// and the address bits hold its blob id.
+#define COLD_AVL_BIT 0x8
+
+// Recorded pages past which an invalidation batch flushes the whole TLB.
+#define UMM_INVLPG_MAX 32
+
 // For the page allocator.
 enum Orders {
   SMALL_ORDER = 0,
@@ -154,6 +165,28 @@ static_assert(sizeof(lin_addr) == sizeof(uint64_t), "Bad lin_addr SZ");
 namespace UmPgTblMgmt {
   void doubleCacheInvalidate(simple_pte *root, uint8_t lvl);
   void flushTranslationCaches();
+  // Set CR4.PCIDE on this core, false if PCIDs aren't available.
+  bool enablePCID();
+  // Reload cr3 tagged with pcid, translations cached under it survive unless
+  // flush. The root is unchanged unless pml4 is given.
+  void loadPCID(uint16_t pcid, bool flush, simple_pte *pml4 = nullptr);
+
+  // Batches the invalidations for entries changed in place. Walkers record the
+  // address of each entry they downgrade or remap, Commit then invlpgs each
+  // page, or flushes the current PCID if there were too many.
+  class InvalidationTracker {
+  public:
+    // A non-leaf entry stands for every page under it.
+    void Record(lin_addr la, bool leaf = true);
+    void Commit();
+    size_t Count() const { return n_; }
+    bool Full() const { return full_; }
+
+  private:
+    lin_addr pages_[UMM_INVLPG_MAX];
+    size_t n_ = 0;
+    bool full_ = false;
+  };
 
   // NOTE: NYI. Higher level operations on page tables.
   // static void areEqual();
@@ -169,19 +202,52 @@ namespace UmPgTblMgmt {
   void countValidPages(std::vector<uint64_t> &counts, simple_pte *root = nullptr, uint8_t lvl = PML4_LEVEL);
   void countValidPTEs(std::vector<uint64_t> &counts, simple_pte *root = nullptr, uint8_t lvl = PML4_LEVEL);
 
-  void traverseValidPages(simple_pte *root, uint8_t lvl);
   uintptr_t injectOffset(lin_addr la, unsigned char lvl);
 
-  // Copiers
+  // Copiers, built on the templated walker in UmPgTblWalker.h.
   simple_pte * walkPgTblCOW(simple_pte *root, simple_pte *copy, uint8_t lvl);
   simple_pte * walkPgTblCopyDirtyCOW(simple_pte *root, simple_pte *copy, uint8_t lvl);
 
+  // A page table copied apart from the rest, so the copy can be split across
+  // cores. Only reads the source through its physical address.
+  struct CopyUnit {
+    simple_pte *src;  // Source table
+    lin_addr virt;    // Its first page
+    simple_pte *copy; // Copied table, nullptr if nothing in it was copied
+  };
+  // As walkPgTblCopyDirtyCOW, but non shared page tables are left to
+  // copyUnit and only recorded in units.
+  simple_pte * walkPgTblCopyDirtyCOW(simple_pte *root, simple_pte *copy, uint8_t lvl,
+                                     std::vector<CopyUnit> &units);
+  void copyUnit(CopyUnit &u);
+  // Install the copied tables of units into copy.
+  simple_pte * linkUnits(simple_pte *copy, uint8_t lvl,
+                         const std::vector<CopyUnit> &units);
+
+  // COW reference every dirty page, write protecting the ones root owns. No
+  // page is copied, the first write on either side does.
+  simple_pte * walkPgTblLazyCOW(simple_pte *root, simple_pte *copy, uint8_t lvl,
+                                InvalidationTracker &inv);
+
   simple_pte * walkPgTblCopyDirty(simple_pte *root, simple_pte *copy = nullptr);
   simple_pte * walkPgTblCopyDirty(simple_pte *root, simple_pte *copy, uint8_t lvl);
+  // Deep copy only pages written since the parent snapshot, (RW & dirty).
+  simple_pte * walkPgTblCopyDelta(simple_pte *root, simple_pte *copy, uint8_t lvl);
+  // Copy a single table, entries are read only and subtrees shared.
+  simple_pte * shareTable(simple_pte *root, uint8_t lvl);
+  // Replace the shared table under pte with a private copy.
+  void unshareTable(simple_pte *pte, uint8_t lvl);
 
 
   // Extractors
   // simple_pte *addrToPTE(lin_addr la, unsigned char lvl = 4);
+  // Non faulting lookup of the leaf mapping virt, nullptr if not mapped.
+  simple_pte *findLeafPTE(simple_pte *root, uint8_t lvl, lin_addr virt,
+                          uint8_t *leafLvl = nullptr);
+  // Entry for virt at stopLvl, present or not. A larger leaf above stopLvl is
+  // returned instead, nullptr if an intermediate table is missing.
+  simple_pte *findPTE(simple_pte *root, uint8_t lvl, lin_addr virt,
+                      uint8_t stopLvl);
   // Chasers
   lin_addr getPhysAddrRec(lin_addr la, simple_pte *root = nullptr,
                           unsigned char lvl = 4);
@@ -189,7 +255,9 @@ namespace UmPgTblMgmt {
   // Mappers
   simple_pte *mapIntoPgTbl(simple_pte *root, lin_addr phys, lin_addr virt,
                            unsigned char rootLvl, unsigned char mapLvl, unsigned char curLvl,
-                           bool writeFault, bool rdPerm = true, bool execDisable = false);
+                           bool writeFault, bool rdPerm = true, bool execDisable = false,
+                           bool accessed = true,
+                           InvalidationTracker *inv = nullptr);
 
   // Root Getters
   simple_pte *getSlotRoot();
@@ -204,32 +272,21 @@ namespace UmPgTblMgmt {
 
   // NOTE: World of lambdas begins here.
 
-  // Used in traversePageTable.
-  // Predicate, determines whether to follow this entry.
-  typedef std::function<bool(simple_pte *curPte, uint8_t lvl)> predicateFn;
-  // Work to run before recursive call. TODO: is this necessary?
-  typedef std::function<void(simple_pte *curPte, uint8_t lvl)> beforeRecFn;
-  // Work to run after recursive call.
-  typedef std::function<void(simple_pte *childPte, simple_pte *curPte, uint8_t lvl)> afterRecFn;
-  // Work to run when a leaf PTE is uncovered.
-  typedef beforeRecFn leafFn;
-  // Work to run before returning to parent page table.
-  typedef beforeRecFn beforeRetFn;
-
-  // Used in walkPageTable.
-  typedef std::function<uintptr_t(simple_pte *curPte, lin_addr virt, uint8_t lvl)> walkLeafFn;
-  typedef std::function<void(simple_pte *curPte, lin_addr virt, uint8_t lvl)> walkRecFn;
-
   static inline void invlpg(void* m) {
     asm volatile ( "invlpg (%0)" : : "b"(m) : "memory" );
   }
 
+  // Drop a reference to the table at root, freeing what only it referenced.
   void freePageTableLamb(simple_pte *root, unsigned char lvl);
+  // Drop a reference to a frame mapped at lvl, freed with the last one.
+  void putFrame(uintptr_t frame, uint8_t lvl);
 
   void cacheInvalidateValidPagesLamb(simple_pte *root, uint8_t lvl);
 
   lin_addr getPhysAddrLamb(lin_addr la, simple_pte* root, unsigned char lvl);
   simple_pte *addrToPTELamb(lin_addr la, simple_pte* root, unsigned char lvl);
+  void setUserAllPTEsWalkLamb(lin_addr la, simple_pte* root, unsigned char lvl);
+  void dumpAllPTEsWalkLamb(lin_addr la, simple_pte* root, unsigned char lvl);
 
   void printTraversalLamb(simple_pte *root, uint8_t lvl);
 
@@ -237,6 +294,8 @@ namespace UmPgTblMgmt {
                             simple_pte *root, uint8_t lvl);
   void countValidWritePagesLamb(std::vector<uint64_t> &counts,
                            simple_pte *root, uint8_t lvl);
+  // Every present entry at each level, stopping at leaves. Unlike
+  // countValidPTEs, the frames under large pages aren't read as tables.
   void countValidPTEsLamb(std::vector<uint64_t> &counts,
                           simple_pte *root, uint8_t lvl);
 
@@ -247,29 +306,15 @@ namespace UmPgTblMgmt {
                            simple_pte *root, uint8_t lvl);
   void countWritablePagesLamb(std::vector<uint64_t> &counts,
                            simple_pte *root, uint8_t lvl);
+  // Addresses of accessed leaves in private tables, skipping COW references.
+  void collectAccessedPrivatePages(std::vector<uintptr_t> &pages,
+                                   simple_pte *root, uint8_t lvl);
+  // Clear accessed on the leaves of private tables, returns how many 4K pages
+  // had it set. Shared subtrees are skipped, every clone sets their bits.
+  size_t sampleAccessedPages(simple_pte *root, uint8_t lvl,
+                             InvalidationTracker &inv);
 
 
-  // HACK
-  void traverseWriteablePages(simple_pte *root, uint8_t lvl, leafFn L);
-  void traverseAccessedPages(simple_pte *root, uint8_t lvl, leafFn L);
-  void traverseAccessedPages(simple_pte *root, uint8_t lvl, leafFn L, beforeRetFn BRET);
-
-  void traverseValidPages(simple_pte *root, uint8_t lvl, leafFn L);
-
-  void traverseValidPages(simple_pte *root, uint8_t lvl, beforeRecFn BR,
-                          afterRecFn AR, leafFn L, beforeRetFn BRET);
-
-  simple_pte *traversePageTable(simple_pte *root, uint8_t lvl,
-                                predicateFn P, beforeRecFn BR,
-                                afterRecFn AR, leafFn L,
-                                beforeRetFn BRET);
-
-  void setUserAllPTEsWalkLamb(lin_addr la, simple_pte* root, unsigned char lvl);
-  void dumpAllPTEsWalkLamb(lin_addr la, simple_pte* root, unsigned char lvl);
-
-  uintptr_t walkPageTable(simple_pte *root, uint8_t lvl, lin_addr virt, walkLeafFn L);
-  uintptr_t walkPageTable(simple_pte *root, uint8_t lvl, lin_addr virt, walkRecFn R, walkLeafFn L);
-
   simple_pte *mapIntoPgTblLamb(simple_pte *root, lin_addr phys,
                                lin_addr virt, unsigned char rootLvl,
                                unsigned char mapLvl, unsigned char curLvl);
@@ -280,41 +325,30 @@ namespace UmPgTblMgmt {
   // Mapper.
    simple_pte *mapIntoPgTblHelper(simple_pte *root, lin_addr phys,
                                         lin_addr virt, unsigned char rootLvl,
-                                  unsigned char mapLvl, unsigned char curLvl, bool writeFault, bool rdPerm, bool execDisable);
+                                  unsigned char mapLvl, unsigned char curLvl, bool writeFault, bool rdPerm, bool execDisable,
+                                  bool accessed, InvalidationTracker *inv);
   simple_pte *findAndSetPTECOW(simple_pte *root, simple_pte *origPte,
                                  lin_addr virt, unsigned char rootLvl,
                                  unsigned char mapLvl, unsigned char curLvl);
+  // Install a verbatim copy of origPte at mapLvl, creating tables above it.
+  simple_pte *findAndSetPTE(simple_pte *root, simple_pte *origPte,
+                            lin_addr virt, unsigned char rootLvl,
+                            unsigned char mapLvl, unsigned char curLvl);
 
 
   // Counter Helpers
-   void countDirtyPagesHelper(std::vector<uint64_t> &counts, simple_pte *root = nullptr, uint8_t lvl = PML4_LEVEL);
-   void countAccessedPagesHelper(std::vector<uint64_t> &counts, simple_pte *root = nullptr, uint8_t lvl = PML4_LEVEL);
-   void countValidPagesHelper(std::vector<uint64_t> &counts, simple_pte *root = nullptr, uint8_t lvl = PML4_LEVEL);
-   void countValidPTEsHelper(std::vector<uint64_t> &counts, simple_pte *root = nullptr, uint8_t lvl = PML4_LEVEL);
-
-  //  void traverseValidPagesHelper(simple_pte *root, uint8_t);
+   void countValidPTEsHelper(std::vector<uint64_t> &counts, simple_pte *root, uint8_t lvl);
   // Printers Debuggers
    void dumpFullTableAddrsHelper(simple_pte *root, unsigned char lvl);
 
    lin_addr copyDirtyPage(lin_addr src, unsigned char lvl);
-   lin_addr reconstructLinAddrPgFromOffsets(uint64_t *idx);
+   lin_addr reconstructLinAddrPgFromOffsets(uint64_t *idx,
+                                            unsigned char lvl = TBL_LEVEL);
   simple_pte *AddrToPTEHelper(lin_addr la, uint64_t *offsets, simple_pte *root,
                                unsigned char lvl);
   lin_addr cr3ToAddr();
    simple_pte *nextTableOrFrame(simple_pte *pg_tbl_start, uint64_t pg_tbl_offset,
                                unsigned char lvl);
-  simple_pte *walkPgTblCopyDirtyCOWHelper(simple_pte *root,
-                                 simple_pte *copy,
-                                 unsigned char lvl,
-                                 uint64_t *idx);
-   simple_pte *walkPgTblCOWHelper(simple_pte *root,
-                                              simple_pte *copy,
-                                              unsigned char lvl,
-                                              uint64_t *idx);
-  simple_pte *walkPgTblCopyDirtyHelper(simple_pte *root,
-                                 simple_pte *copy,
-                                 unsigned char lvl,
-                                 uint64_t *idx);
 
    lin_addr getPhysAddrRecHelper(lin_addr la, simple_pte *root, unsigned char lvl);
   bool exists (simple_pte *pte);
@@ -323,6 +357,8 @@ namespace UmPgTblMgmt {
    bool isDirty    (simple_pte *pte);
    bool isReadOnly (simple_pte *pte);
    bool isWritable (simple_pte *pte);
+   bool isShared   (simple_pte *pte);
+   bool isCold     (simple_pte *pte);
 // } // anon namespace
 } // namespace UmPgTblMgmt
 }
@@ -0,0 +1,156 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef UMM_UM_PG_TBL_WALKER_H_
+#define UMM_UM_PG_TBL_WALKER_H_
+
+#include <ebbrt/Debug.h>
+
+#include "UmPgTblMgr.h"
+#include "UmPteScan.h"
+
+namespace umm {
+namespace UmPgTblMgmt {
+
+// Linear address of the first slot page, base for walks from the slot PDPT.
+const uint64_t kSlotWalkBase =
+    (0xffffUL << 48) | ((uint64_t)SLOT_PML4_NUM << 39);
+
+/**
+ *  PgTblVisitor - Hooks of the templated walker. Visitors derive from this and
+ *  hide the hooks they need, calls resolve at compile time.
+ *    kVisitBits - PTE bits every visited entry has, see scanTable.
+ *    kLeafBits  - PTE bits every visited leaf has.
+ *    Visit - Entries passing the bit filters, false skips it.
+ *    Leaf  - A page of some size, virt is its linear address.
+ *    Enter - Before walking the table under pte, false prunes the subtree.
+ *    Leave - After the table under pte was walked.
+ *    Exit  - Done with a table, last hook before going back up.
+ *    Cold  - A compressed 4K page, see UmColdStore. Only called with kCold.
+ */
+struct PgTblVisitor {
+  static constexpr uint64_t kVisitBits = PTE_P;
+  static constexpr uint64_t kLeafBits = 0;
+  static constexpr bool kCold = false;
+  bool Visit(simple_pte *pte, uint8_t lvl) { return true; }
+  void Leaf(simple_pte *pte, lin_addr virt, uint8_t lvl) {}
+  bool Enter(simple_pte *pte, lin_addr virt, uint8_t lvl) { return true; }
+  void Leave(simple_pte *pte, lin_addr virt, uint8_t lvl) {}
+  void Exit(simple_pte *table, uint8_t lvl) {}
+  void Cold(simple_pte *pte, lin_addr virt) {}
+};
+
+/** Visitor made of bit filters, a filter function and a leaf action */
+template <uint64_t VisitBits, uint64_t LeafBits, class P, class L>
+struct LeafVisitor : PgTblVisitor {
+  static constexpr uint64_t kVisitBits = VisitBits;
+  static constexpr uint64_t kLeafBits = LeafBits;
+  LeafVisitor(P p, L l) : pred(p), leaf(l) {}
+  bool Visit(simple_pte *pte, uint8_t lvl) { return pred(pte, lvl); }
+  void Leaf(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    leaf(pte, virt, lvl);
+  }
+  P pred;
+  L leaf;
+};
+
+/**
+ *  PgTblLevel - One loop over a table at level Lvl. The level is a template
+ *  argument so leaf tests and address math fold to constants, and each level
+ *  calls into the next one's instantiation. That nest inlines into a single
+ *  function, the loop counters are the walk stack and nothing recurses.
+ *  Only the entries set in the table's scanTable mask are looked at.
+ */
+template <uint8_t Lvl, class V> struct PgTblLevel {
+  static inline __attribute__((always_inline)) void
+  Walk(simple_pte *table, uint64_t base, V &v) {
+    PteMask m;
+    scanTable<V::kVisitBits, V::kLeafBits, false>(table, m);
+    for (uint64_t j = 0; j < 8; j++)
+    for (uint64_t bits = m.w[j]; bits; bits &= bits - 1) {
+      uint64_t i = j * 64 + __builtin_ctzll(bits);
+      simple_pte *pte = table + i;
+      if (!v.Visit(pte, Lvl))
+        continue;
+
+      lin_addr virt;
+      virt.raw = base | (i << (SMALL_PG_SHIFT + 9 * (Lvl - 1)));
+      // Canonical upper half.
+      if (Lvl == PML4_LEVEL && i >= 0x100)
+        virt.raw |= 0xffffUL << 48;
+
+      // No worries about PML4, MAPS is reserved to 0.
+      if (pte->decompCommon.MAPS) {
+        v.Leaf(pte, virt, Lvl);
+      } else if (v.Enter(pte, virt, Lvl)) {
+        auto next = (simple_pte *)((uint64_t)pte->decompCommon.PG_TBL_ADDR
+                                   << SMALL_PG_SHIFT);
+        PgTblLevel<Lvl - 1, V>::Walk(next, virt.raw, v);
+        v.Leave(pte, virt, Lvl);
+      }
+    }
+    v.Exit(table, Lvl);
+  }
+};
+
+template <class V> struct PgTblLevel<TBL_LEVEL, V> {
+  static inline __attribute__((always_inline)) void
+  Walk(simple_pte *table, uint64_t base, V &v) {
+    PteMask m;
+    scanTable<V::kVisitBits, V::kLeafBits, true>(table, m);
+    // Cold markers are only ever 4K leaves.
+    if (V::kCold) {
+      PteMask c;
+      scanTable<PTE_COLD, 0, true>(table, c);
+      for (uint64_t j = 0; j < 8; j++)
+        m.w[j] |= c.w[j];
+    }
+    for (uint64_t j = 0; j < 8; j++)
+    for (uint64_t bits = m.w[j]; bits; bits &= bits - 1) {
+      uint64_t i = j * 64 + __builtin_ctzll(bits);
+      simple_pte *pte = table + i;
+      lin_addr virt;
+      virt.raw = base | (i << SMALL_PG_SHIFT);
+      if (V::kCold && !pte->decompCommon.SEL) {
+        v.Cold(pte, virt);
+        continue;
+      }
+      if (!v.Visit(pte, TBL_LEVEL))
+        continue;
+      v.Leaf(pte, virt, TBL_LEVEL);
+    }
+    v.Exit(table, TBL_LEVEL);
+  }
+};
+
+/** Walk the table at root, base is the linear address of its first entry */
+template <class V>
+void walkPgTbl(simple_pte *root, uint8_t lvl, uint64_t base, V &v) {
+  switch (lvl) {
+  case PML4_LEVEL: PgTblLevel<PML4_LEVEL, V>::Walk(root, base, v); break;
+  case PDPT_LEVEL: PgTblLevel<PDPT_LEVEL, V>::Walk(root, base, v); break;
+  case DIR_LEVEL:  PgTblLevel<DIR_LEVEL, V>::Walk(root, base, v); break;
+  case TBL_LEVEL:  PgTblLevel<TBL_LEVEL, V>::Walk(root, base, v); break;
+  default: ebbrt::kabort("Bad page table level %d\n", lvl);
+  }
+}
+
+/** Walk leaves passing the bit filters and pred, entries failing them are
+ *  skipped with their subtree */
+template <uint64_t VisitBits, uint64_t LeafBits, class P, class L>
+void walkPgTblLeaves(simple_pte *root, uint8_t lvl, uint64_t base, P pred,
+                     L leaf) {
+  LeafVisitor<VisitBits, LeafBits, P, L> v(pred, leaf);
+  walkPgTbl(root, lvl, base, v);
+}
+
+/** Base for a walk of the slot, rooted at the PML4 or the slot's PDPT */
+inline uint64_t slotWalkBase(uint8_t lvl) {
+  return lvl == PML4_LEVEL ? 0 : kSlotWalkBase;
+}
+
+} // namespace UmPgTblMgmt
+} // namespace umm
+
+#endif // UMM_UM_PG_TBL_WALKER_H_
@@ -0,0 +1,196 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef UMM_UM_PTE_SCAN_H_
+#define UMM_UM_PTE_SCAN_H_
+
+/** UmPteScan.h
+ *  Bitmask scans of a whole 512 entry table. Walkers iterate the set bits
+ *  instead of testing entries one bitfield at a time, sparse tables cost a few
+ *  vector ops per cache line.
+ */
+
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef UMM_PTE_SCAN_AVX2
+#include <immintrin.h>
+#endif
+
+#include "UmPgTblMgr.h"
+
+// AVX2 clobbers the upper ymm halves, which the fxsave area of an
+// ExceptionFrame doesn't hold. Only enable it when nothing running in the
+// slot uses AVX.
+// #define UMM_PTE_SCAN_AVX2
+
+// PTE bits the scanners test.
+#define PTE_P (1UL << 0)
+#define PTE_RW (1UL << 1)
+#define PTE_A (1UL << 5)
+#define PTE_D (1UL << 6)
+#define PTE_PS (1UL << 7)
+#define PTE_COLD ((uint64_t)COLD_AVL_BIT << 8)
+
+namespace umm {
+namespace UmPgTblMgmt {
+
+/** One bit per entry of a table */
+struct PteMask {
+  uint64_t w[8];
+  size_t Count() const {
+    size_t n = 0;
+    for (auto m : w)
+      n += __builtin_popcountll(m);
+    return n;
+  }
+};
+
+namespace scan {
+#ifdef __SSE2__
+// Bit B of two entries, into bits 0 and 1.
+template <uint64_t B> inline int bitSSE2(__m128i v) {
+  return _mm_movemask_pd(_mm_castsi128_pd(_mm_slli_epi64(v, 63 - B)));
+}
+#endif
+
+/** AllSet<Bits> - Mask of the entries in a vector with all of Bits set */
+template <uint64_t Bits> struct AllSet {
+  static const uint64_t B = __builtin_ctzll(Bits);
+#ifdef __SSE2__
+  static inline int SSE2(__m128i v) {
+    return bitSSE2<B>(v) & AllSet<Bits & (Bits - 1)>::SSE2(v);
+  }
+#endif
+#ifdef UMM_PTE_SCAN_AVX2
+  __attribute__((target("avx2"))) static inline int AVX2(__m256i v) {
+    return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_slli_epi64(
+               v, 63 - B))) &
+           AllSet<Bits & (Bits - 1)>::AVX2(v);
+  }
+#endif
+};
+
+template <> struct AllSet<0> {
+#ifdef __SSE2__
+  static inline int SSE2(__m128i v) { return 0x3; }
+#endif
+#ifdef UMM_PTE_SCAN_AVX2
+  __attribute__((target("avx2"))) static inline int AVX2(__m256i v) {
+    return 0xf;
+  }
+#endif
+};
+
+// Leaf tables test both sets of bits, above that an entry with PS clear is a
+// table and only needs the Visit bits.
+template <uint64_t Visit, uint64_t Leaf, bool LeafLvl>
+inline bool scalar(uint64_t raw) {
+  if ((raw & Visit) != Visit)
+    return false;
+  if (!LeafLvl && !(raw & PTE_PS))
+    return true;
+  return (raw & Leaf) == Leaf;
+}
+
+template <uint64_t Visit, uint64_t Leaf, bool LeafLvl>
+void tableScalar(const simple_pte *t, PteMask &m) {
+  for (int j = 0; j < 8; j++) {
+    uint64_t bits = 0;
+    for (int k = 0; k < 64; k++)
+      bits |= (uint64_t)scalar<Visit, Leaf, LeafLvl>(t[j * 64 + k].raw) << k;
+    m.w[j] = bits;
+  }
+}
+
+#ifdef __SSE2__
+template <uint64_t Visit, uint64_t Leaf, bool LeafLvl>
+inline void tableSSE2(const simple_pte *t, PteMask &m) {
+  for (int j = 0; j < 8; j++) {
+    uint64_t bits = 0;
+    for (int k = 0; k < 64; k += 2) {
+      __m128i v = _mm_load_si128((const __m128i *)(t + j * 64 + k));
+      int b = AllSet<Visit>::SSE2(v);
+      if (LeafLvl)
+        b &= AllSet<Leaf>::SSE2(v);
+      else if (Leaf)
+        b &= ~AllSet<PTE_PS>::SSE2(v) | AllSet<Leaf>::SSE2(v);
+      bits |= (uint64_t)b << k;
+    }
+    m.w[j] = bits;
+  }
+}
+#endif
+
+#ifdef UMM_PTE_SCAN_AVX2
+template <uint64_t Visit, uint64_t Leaf, bool LeafLvl>
+__attribute__((target("avx2"), noinline)) void
+tableAVX2(const simple_pte *t, PteMask &m) {
+  for (int j = 0; j < 8; j++) {
+    uint64_t bits = 0;
+    for (int k = 0; k < 64; k += 4) {
+      __m256i v = _mm256_load_si256((const __m256i *)(t + j * 64 + k));
+      int b = AllSet<Visit>::AVX2(v);
+      if (LeafLvl)
+        b &= AllSet<Leaf>::AVX2(v);
+      else if (Leaf)
+        b &= ~AllSet<PTE_PS>::AVX2(v) | AllSet<Leaf>::AVX2(v);
+      bits |= (uint64_t)b << k;
+    }
+    m.w[j] = bits;
+  }
+  _mm256_zeroupper();
+}
+
+// CPUID.07H:EBX.AVX2, and the OS saves ymm state (XCR0 bits 1 and 2).
+inline bool avx2Usable() {
+  static int usable = -1;
+  if (usable < 0) {
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ __volatile__("cpuid"
+                         : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                         : "a"(1), "c"(0));
+    bool osxsave = (ecx >> 27) & 0x1;
+    __asm__ __volatile__("cpuid"
+                         : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                         : "a"(7), "c"(0));
+    bool avx2 = (ebx >> 5) & 0x1;
+    uint64_t xcr0 = 0;
+    if (osxsave) {
+      uint32_t lo, hi;
+      __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+      xcr0 = ((uint64_t)hi << 32) | lo;
+    }
+    usable = avx2 && (xcr0 & 0x6) == 0x6;
+  }
+  return usable;
+}
+#endif
+} // namespace scan
+
+/**
+ *  scanTable - Mask of the entries of table t with all of Visit set, entries
+ *  that map a page must also have all of Leaf set. LeafLvl means every entry
+ *  is a page (TBL_LEVEL).
+ */
+template <uint64_t Visit, uint64_t Leaf, bool LeafLvl>
+inline void scanTable(const simple_pte *t, PteMask &m) {
+#ifdef UMM_PTE_SCAN_AVX2
+  if (scan::avx2Usable()) {
+    scan::tableAVX2<Visit, Leaf, LeafLvl>(t, m);
+    return;
+  }
+#endif
+#ifdef __SSE2__
+  scan::tableSSE2<Visit, Leaf, LeafLvl>(t, m);
+#else
+  scan::tableScalar<Visit, Leaf, LeafLvl>(t, m);
+#endif
+}
+
+} // namespace UmPgTblMgmt
+} // namespace umm
+
+#endif // UMM_UM_PTE_SCAN_H_
@@ -35,6 +35,11 @@ UmPth::~UmPth(){
   // kprintf_force("Freed the page table!\n");
 }
 
+void UmPth::SetRoot(simple_pte *root) {
+  kassert(root_ == nullptr && root != nullptr);
+  root_ = root;
+}
+
 UmPth& UmPth::operator=(const UmPth& rhs){
   // NOTE: RHS better be a sv or need to dump translation caches.
   lvl_ = rhs.lvl_;
@@ -53,7 +58,7 @@ UmPth& UmPth::operator=(const UmPth& rhs){
     root_ = UmPgTblMgmt::walkPgTblCopyDirty(const_cast<simple_pte *>(rhs.root_),
                                             root_, lvl_);
 
-#else
+#elif defined(NOSHARE)
 
 // USE COW
 #if PTH_CTRS
@@ -62,6 +67,12 @@ UmPth& UmPth::operator=(const UmPth& rhs){
     // COW read only dirty pages, deep copy RW dirty pages from other pth.
     root_ = UmPgTblMgmt::walkPgTblCOW(const_cast<simple_pte *>(rhs.root_),
                                       root_, lvl_);
+#else
+
+// SHARE TABLES
+    // Only the top table is copied, subtrees are shared read only with rhs
+    // and copied on first write beneath them (see mapIntoPgTbl).
+    root_ = UmPgTblMgmt::shareTable(const_cast<simple_pte *>(rhs.root_), lvl_);
 #endif
 
 #if PTH_CTRS
@@ -74,9 +85,8 @@ UmPth& UmPth::operator=(const UmPth& rhs){
 // TODO: const Not used delete me.
 void UmPth::copyInPages(const simple_pte *srcRoot) {
 
-  // Flush dirty bits out of caches.
-  UmPgTblMgmt::flushTranslationCaches();
-
+  // Hardware sets dirty bits in memory on the first write, nothing is
+  // changed in place below so no TLB invalidation is needed.
 #ifdef NOCOW
   root_ = UmPgTblMgmt::walkPgTblCopyDirty(const_cast<simple_pte *>(srcRoot),
                                           root_, lvl_);
@@ -91,11 +101,23 @@ void UmPth::copyInPages(const simple_pte *srcRoot) {
 
   kassert(root_ != nullptr);
 }
+void UmPth::copyInDeltaPages(const simple_pte *srcRoot) {
+  // No flush, see copyInPages.
+  // Read only dirty pages belong to an ancestor snapshot, they are left to be
+  // resolved through UmSV::parent_. NOTE: root_ stays nullptr if nothing was
+  // written since the parent.
+  root_ = UmPgTblMgmt::walkPgTblCopyDelta(const_cast<simple_pte *>(srcRoot),
+                                          root_, lvl_);
+}
+
   size_t UmPth::CountOwnedPages() const{
+    if (root_ == nullptr)
+      return 0;
     std::vector<uint64_t> counts (5);
     UmPgTblMgmt::countWritablePagesLamb(counts, root_, lvl_);
 
-    return counts[1];
+    // In units of 4K pages.
+    return counts[TBL_LEVEL] + (counts[DIR_LEVEL] << MEDIUM_ORDER);
 
   }
 }
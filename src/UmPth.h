@@ -25,7 +25,11 @@ public:
   UmPth& operator=(const UmPth& rhs);
 	// public methods
   simple_pte *Root() const { return root_; }
+  /** Take over a table built in the slot, along with its reference */
+  void SetRoot(simple_pte *root);
   void copyInPages(const simple_pte *srcRoot);
+  /** Copy in only the pages written since the source was cloned */
+  void copyInDeltaPages(const simple_pte *srcRoot);
   void printMappedPagesCount() const;
 
   size_t CountOwnedPages() const;
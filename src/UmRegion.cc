@@ -2,6 +2,8 @@
 // Distributed under the Boost Software License, Version 1.0.
 //    (See accompanying file LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
+#include <algorithm>
+
 #include "UmRegion.h"
 #include "umm-internal.h"
 
@@ -22,12 +24,75 @@ void Region::ZeroPFC() {
   count = 0;
 }
 
+void RegionTable::Build(std::list<Region> &regions) {
+  kassert(regions.size() <= kMaxRegions);
+  n_ = 0;
+  for (auto &reg : regions) {
+    Entry &e = entries_[n_++];
+    e.start = reg.start;
+    e.end = reg.start + reg.length;
+    e.reg = &reg;
+    e.page_order = reg.page_order;
+    e.flags = 0;
+    if (reg.writable)
+      e.flags |= write;
+    if (reg.data == nullptr) {
+      if (!(reg.name == ".bss" || reg.name == "usr"))
+        e.flags |= unknown;
+      e.flags |= zero_fill;
+    } else {
+      e.flags |= elf;
+    }
+    if (!reg.writable && !(reg.name == ".text" || reg.name == ".rodata"))
+      e.flags |= unknown;
+    // Presumably an interpreter executes on the usr segment.
+    if (reg.name == ".text" || reg.name == "usr")
+      e.flags |= exec;
+    // Only immutable ELF data and demand zero pages are safe to map early.
+    if ((!reg.writable || reg.name == ".bss") && !(e.flags & unknown))
+      e.flags |= around;
+  }
+  std::sort(entries_, entries_ + n_, [](const Entry &a, const Entry &b) {
+    return a.start < b.start;
+  });
+  for (size_t i = 0; i < kMaxRegions; i++) {
+    starts_[i] = (i < n_) ? entries_[i].start : UINTPTR_MAX;
+    kassert(i == 0 || i >= n_ || entries_[i - 1].end <= entries_[i].start);
+  }
+}
+
+void RegionTable::Rebase(const std::list<Region> &from,
+                         std::list<Region> &to) {
+  kassert(from.size() == to.size());
+  for (size_t i = 0; i < n_; i++) {
+    auto t = to.begin();
+    for (auto f = from.begin(); f != from.end(); ++f, ++t) {
+      if (entries_[i].reg == &*f) {
+        entries_[i].reg = &*t;
+        break;
+      }
+    }
+    kassert(t != to.end());
+  }
+}
+
+const RegionTable::Entry *RegionTable::Find(uintptr_t vaddr) const {
+  // Last start at or below vaddr, the compares become conditional moves.
+  size_t i = 0;
+  for (size_t step = kMaxRegions / 2; step; step >>= 1)
+    i = (starts_[i + step] <= vaddr) ? i + step : i;
+  if (n_ == 0 || vaddr < starts_[i] || vaddr >= entries_[i].end)
+    return nullptr;
+  return &entries_[i];
+}
+
 void Region::Print() {
   kprintf_force("Region name: %s\n", name.c_str());
   kprintf_force("      start: %p\n", start);
   kprintf_force("       size: %llu\n", length);
   kprintf_force("  read-only: %d\n", !writable);
   kprintf_force("  page size: %d\n", kPageSize << page_order);
+  kprintf_force("fault-around: %d\n", fault_around);
   kprintf_force("page faults: %d\n", count);
   kprintf_force("       data: %llx\n", data);
 }
@@ -1,6 +1,7 @@
 #ifndef UMM_UM_UMREGION_H_
 #define UMM_UM_UMREGION_H_
 
+#include <list>
 #include <string>
 #include "umm-common.h"
 
@@ -18,6 +19,9 @@ namespace umm {
                                                    interfaces */
     unsigned char *data = nullptr;              // Location of backing data.
                                                 // TODO: Change to uintptr_t
+    size_t fault_around = UMM_REGION_FAULT_AROUND; /** Aligned window of pages
+                                                      mapped on a fault to
+                                                      immutable data or .bss */
     /* Transient state */                       // XXX: Clear on copy?
     size_t count = 0;                           /** Page faults on region */
 
@@ -38,6 +42,48 @@ namespace umm {
     // bool equal_metadata(const Region& rhs) const;
     // bool equal_data(const Region& rhs) const;
   }; // UmSV::Region
+
+  /** RegionTable - Sorted index of an SV's regions for the fault path. What
+   *  a fault needs to know about a region is worked out once, when the table
+   *  is built, so lookups never touch the names. */
+  class RegionTable {
+  public:
+    enum Flags : uint8_t {
+      exec = 1 << 0,      // Mapped executable
+      write = 1 << 1,     // Mapped writable
+      zero_fill = 1 << 2, // No backing data, pages start zeroed
+      elf = 1 << 3,       // Backed by the ELF image
+      around = 1 << 4,    // Neighbours of a fault may be mapped early
+      unknown = 1 << 5    // Not a region the fault path expects, abort on use
+    };
+    struct Entry {
+      uintptr_t start;
+      uintptr_t end; // Exclusive
+      Region *reg;
+      uint8_t flags;
+      uint8_t page_order;
+    };
+    static const size_t kMaxRegions = 32;
+
+    /** Index regions, which must not overlap and must outlive the table */
+    void Build(std::list<Region> &regions);
+    /** Re-point a copied table from the regions of from to their copies in
+     *  to, which must be a copy of from in the same order */
+    void Rebase(const std::list<Region> &from, std::list<Region> &to);
+    /** Forget the regions, the next lookup rebuilds */
+    void Clear() { n_ = 0; }
+    bool Empty() const { return n_ == 0; }
+    /** Entry of the region holding vaddr, nullptr if there is none */
+    const Entry *Find(uintptr_t vaddr) const;
+
+  private:
+    // Searched apart from the entries, a few cache lines for the whole
+    // search. Padded out with UINTPTR_MAX so it always takes
+    // log2(kMaxRegions) steps. Not alignas(64), UmSV is allocated with new.
+    uintptr_t starts_[kMaxRegions];
+    Entry entries_[kMaxRegions];
+    size_t n_ = 0;
+  };
 } // umm
 
 #endif // end UMM_UM_UMREGION_H_
@@ -3,6 +3,7 @@
 //    (See accompanying file LICENSE_1_0.txt or copy at
 //          http://www.boost.org/LICENSE_1_0.txt)
 #include "UmSV.h"
+#include "UmColdStore.h"
 #include "UmRegion.h"
 
 #include "umm-internal.h"
@@ -11,14 +12,63 @@ namespace umm{
     kassert(&rhs != nullptr);
 
     // kprintf(RED "region list copy\n" RESET);
-    region_list_ = rhs.region_list_;
+    CopyRegions(rhs);
     ef = rhs.ef;
     pth = rhs.pth;
+    parent_ = rhs.parent_;
+    ws_ = rhs.ws_;
+    captured_ = rhs.captured_;
     // kprintf(GREEN "Copy cons.\n" RESET);
   }
 
+UmSV::~UmSV() {
+  // Blobs of our compressed pages go with us.
+  if (cold_tracked_)
+    cold_store->Forget(*this);
+}
+
 void UmSV::SetEntry(uintptr_t paddr) { ef.rip = paddr; }
-void UmSV::AddRegion(Region &reg) { region_list_.push_back(reg); }
+void UmSV::AddRegion(Region &reg) {
+  region_list_.push_back(reg);
+  region_table_.Clear();
+}
+
+void UmSV::CopyRegions(const UmSV &other) {
+  region_list_ = other.region_list_;
+  // Keep a built table, pointing at our own copies of the regions.
+  region_table_ = other.region_table_;
+  region_table_.Rebase(other.region_list_, region_list_);
+}
+
+void UmSV::EnableWorkingSetPrefetch() {
+  if (!ws_)
+    ws_ = std::make_shared<WorkingSet>();
+}
+
+void UmSV::RecordWss(uint64_t pages) const {
+  // Clones on other cores go away concurrently.
+  auto avg = wss_pages_.load();
+  while (!wss_pages_.compare_exchange_weak(avg, wss_ewma(avg, pages, avg == 0)))
+    ;
+}
+
+void UmSV::AddUser() const {
+  while (true) {
+    auto u = users_.load();
+    if (u == kFreezing) {
+      __asm__ __volatile__("pause");
+      continue;
+    }
+    if (users_.compare_exchange_weak(u, u + 1))
+      break;
+  }
+  last_used_ = ebbrt::clock::Wall::Now();
+}
+
+void UmSV::RemoveUser() const {
+  kassert(users_ != 0 && users_ != kFreezing);
+  users_--;
+}
 
 void UmSV::ZeroPFCs() {
   for (auto &reg : region_list_)
@@ -39,13 +89,16 @@ void UmSV::Print() {
 }
 
 Region& UmSV::GetRegionOfAddr(uintptr_t vaddr) {
-  for (auto &reg : region_list_) {
-    if (reg.AddrIsInRegion(vaddr)){
-      return reg;
-    }
-  }
-  kabort("Umm... No region found for addr %p n", vaddr);
-  while(1);
+  return *GetRegionEntry(vaddr).reg;
+}
+
+const RegionTable::Entry &UmSV::GetRegionEntry(uintptr_t vaddr) {
+  if (region_table_.Empty())
+    region_table_.Build(region_list_);
+  auto e = region_table_.Find(vaddr);
+  if (e == nullptr)
+    kabort("Umm... No region found for addr %p n", vaddr);
+  return *e;
 }
 
 
@@ -61,6 +114,36 @@ UmSV::GetRegionByName(const char* p){
   while(1);
 }
 
+simple_pte *UmSV::GetParentPTE(uintptr_t vaddr, uint8_t *lvl) const {
+  lin_addr la;
+  la.raw = vaddr;
+  // Nearest ancestor wins, it holds the most recent version of the page.
+  for (auto sv = parent_; sv != nullptr; sv = sv->parent_) {
+    auto pte = UmPgTblMgmt::findLeafPTE(sv->pth.Root(), PDPT_LEVEL, la, lvl);
+    if (pte != nullptr)
+      return pte;
+    // Compressed, thawing hands back the entry of the frame's owner.
+    pte = UmPgTblMgmt::findPTE(sv->pth.Root(), PDPT_LEVEL, la, TBL_LEVEL);
+    if (pte != nullptr && UmPgTblMgmt::isCold(pte)) {
+      if (lvl != nullptr)
+        *lvl = TBL_LEVEL;
+      return cold_store->Thaw(pte);
+    }
+  }
+  return nullptr;
+}
+
+bool UmSV::ParentMapsRange(uintptr_t vaddr, uint8_t lvl) const {
+  lin_addr la;
+  la.raw = vaddr;
+  for (auto sv = parent_; sv != nullptr; sv = sv->parent_) {
+    auto pte = UmPgTblMgmt::findPTE(sv->pth.Root(), PDPT_LEVEL, la, lvl);
+    if (pte != nullptr && UmPgTblMgmt::exists(pte))
+      return true;
+  }
+  return false;
+}
+
   size_t UmSV::CountOwnedPages() const{
     // Owned pages are a subset of all pages. They only include pages that have
     // been write faulted or copy on write faulted in. Doesn't count COW
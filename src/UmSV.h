@@ -6,11 +6,44 @@
 #define UMM_UM_SV_H_
 
 // #include "umm-common.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
 #include "UmPth.h"
 #include "UmRegion.h"
 
 namespace umm {
 
+/** WorkingSet - Pages the first clone of a snapshot faulted on, in order.
+ *  Later clones of the snapshot map them in one go before entering the guest
+ */
+struct WorkingSet {
+  enum State : uint8_t { empty = 0, recording, recorded };
+  struct Fault {
+    uintptr_t vaddr; // Page aligned
+    uint64_t ec;     // x86_64::PgFaultErrorCode
+  };
+  std::atomic<State> state{empty};
+  std::vector<Fault> faults;
+
+  /** Drop an unfinished recording, the next clone to load starts over */
+  void Abandon() {
+    faults.clear();
+    state.store(empty);
+  }
+};
+
+// Weight of a new sample in working set size averages, 1/2^shift.
+#define UMM_WSS_EWMA_SHIFT 2
+
+/** Moving average of working set sizes, a first sample starts it */
+inline uint64_t wss_ewma(uint64_t avg, uint64_t sample, bool first) {
+  if (first)
+    return sample;
+  return avg - (avg >> UMM_WSS_EWMA_SHIFT) + (sample >> UMM_WSS_EWMA_SHIFT);
+}
+
 /** UmSV - State Vector
  * A data type containing the raw execution state of the process. To be
  * executed a raw SV must be instantiated into a executable type
@@ -53,14 +86,36 @@ public:
 
 
   UmSV(const UmSV& rhs);
+  ~UmSV();
 
   void SetEntry(uintptr_t paddr);
   void AddRegion(Region &reg);
+  /** Take the regions of other, and its region table if it's built */
+  void CopyRegions(const UmSV &other);
   void ZeroPFCs();
   void Print();
   size_t CountOwnedPages() const;
+  /** Find the PTE mapping vaddr in the parent snapshot chain, or nullptr */
+  simple_pte *GetParentPTE(uintptr_t vaddr, uint8_t *lvl = nullptr) const;
+  /** True if any ancestor has an entry at lvl covering vaddr */
+  bool ParentMapsRange(uintptr_t vaddr, uint8_t lvl) const;
+  /** Record the working set of the next clone, prefetch it for the rest */
+  void EnableWorkingSetPrefetch();
+  /** Working set size of clones in 4K pages, averaged over the estimates of
+   *  those sampled. 0 until one goes away, see USE_WSS_SAMPLER */
+  uint64_t WssPages() const { return wss_pages_; }
+  /** Fold the estimate of a clone into WssPages */
+  void RecordWss(uint64_t pages) const;
+  /** True for captured snapshots, boot images from an elf are not */
+  bool IsSnapshot() const { return captured_; }
+  /** Clone accounting, a snapshot in use is never frozen. AddUser waits out a
+   *  freeze in progress, see UmColdStore */
+  void AddUser() const;
+  void RemoveUser() const;
   // void deepCopy(const UmSV other);
   umm::Region& GetRegionOfAddr(uintptr_t vaddr);
+  /** Fault path lookup, the region table is built on first use */
+  const RegionTable::Entry &GetRegionEntry(uintptr_t vaddr);
   const Region& GetRegionByName(const char *p);
 
   // UmSV& operator=(const UmSV& rhs);
@@ -68,8 +123,30 @@ public:
   // void deepCopyRegionList(const UmSV& other);
 
   std::list<Region> region_list_; // TODO: generic type
+  // Index of region_list_, cleared by AddRegion. Copies rebase it onto their
+  // own list, see CopyRegions.
+  RegionTable region_table_;
   ExceptionFrame ef;
   UmPth pth;
+  // Delta snapshots only store pages written since this parent was cloned,
+  // everything else is faulted through the chain. Parent must outlive us.
+  const UmSV *parent_ = nullptr;
+  // Shared by all clones, nullptr unless prefetching is enabled.
+  std::shared_ptr<WorkingSet> ws_;
+  // Captured from a running instance or restored from an image. Boot images
+  // have tables too, see UMM_PREBUILT_RO_TABLES.
+  bool captured_ = false;
+
+  /** Cold store state, none of it is copied to clones */
+  static const uint32_t kFreezing = UINT32_MAX;
+  mutable std::atomic<uint32_t> users_{0}; // Live clones, or kFreezing
+  // Set once a snapshot is captured on top of this one, the new snapshot
+  // may reference our frames so they can't be compressed anymore.
+  mutable std::atomic<bool> pinned_{false};
+  mutable ebbrt::clock::Wall::time_point last_used_;
+  bool cold_tracked_ = false;
+  /** Not copied either, clones estimate their own */
+  mutable std::atomic<uint64_t> wss_pages_{0};
 
 }; // UmSV
 } // umm
@@ -0,0 +1,279 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "UmColdStore.h"
+#include "UmFrameRef.h"
+#include "UmLoader.h"
+#include "UmPgMagazine.h"
+#include "UmPgTblWalker.h"
+#include "UmSvImage.h"
+#include "umm-internal.h"
+
+namespace {
+using umm::lin_addr;
+using umm::simple_pte;
+
+uint64_t align_up(uint64_t v, uint64_t a) { return (v + a - 1) & ~(a - 1); }
+
+// Pages createSVFromElf maps itself, left out of images.
+bool prebuilt(const umm::UmSV &sv, uint64_t vaddr) {
+#if UMM_PREBUILT_RO_TABLES
+  for (const auto &reg : sv.region_list_) {
+    if (!reg.writable && vaddr >= reg.start && vaddr < reg.start + reg.length)
+      return true;
+  }
+#endif
+  return false;
+}
+
+uint64_t fnv1a(uint64_t h, const void *p, size_t n) {
+  auto b = (const uint8_t *)p;
+  for (size_t i = 0; i < n; i++) {
+    h ^= b[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Every record and page lies inside the image. Checked before anything is
+// allocated, a bad image restores nothing.
+bool in_bounds(const umm::SvImage::Header *h) {
+  using namespace umm::SvImage;
+  if (h->region_off > h->len || h->index_off > h->len || h->data_off > h->len)
+    return false;
+  if (h->nregions > umm::RegionTable::kMaxRegions ||
+      h->nregions > (h->len - h->region_off) / sizeof(RegionRec))
+    return false;
+  if (h->npages > (h->len - h->index_off) / sizeof(PageRec))
+    return false;
+  auto pr = (const PageRec *)((const uint8_t *)h + h->index_off);
+  for (uint32_t i = 0; i < h->npages; i++, pr++) {
+    if (pr->lvl != TBL_LEVEL && pr->lvl != DIR_LEVEL)
+      return false;
+    simple_pte e;
+    e.raw = pr->entry;
+    uint64_t off = (uint64_t)e.decompCommon.PG_TBL_ADDR << SMALL_PG_SHIFT;
+    if (off > h->len - h->data_off ||
+        pgBytes[pr->lvl] > h->len - h->data_off - off)
+      return false;
+  }
+  return true;
+}
+
+struct Page {
+  uint64_t vaddr;
+  simple_pte pte;
+  uint8_t lvl;
+};
+
+// Every leaf of a snapshot, shared subtrees included. Compressed pages are
+// thawed so their data can be read.
+struct ImageVisitor : umm::UmPgTblMgmt::PgTblVisitor {
+  static constexpr bool kCold = true;
+  explicit ImageVisitor(std::vector<Page> &p) : pages(p) {}
+  void Leaf(simple_pte *pte, lin_addr virt, uint8_t lvl) {
+    // 1G NYI.
+    kassert(lvl <= DIR_LEVEL);
+    pages.push_back({virt.raw, *pte, lvl});
+  }
+  void Cold(simple_pte *pte, lin_addr virt) {
+    auto owner = umm::cold_store->Thaw(pte);
+    pages.push_back({virt.raw, *owner, TBL_LEVEL});
+  }
+  std::vector<Page> &pages;
+};
+}
+
+uint64_t umm::SvImage::ElfId(const unsigned char *elf_start) {
+  auto eh = (const ElfLoader::Ehdr *)elf_start;
+  uint64_t h = fnv1a(0xcbf29ce484222325ULL, eh, sizeof(*eh));
+  return fnv1a(h, elf_start + eh->e_shoff,
+               (size_t)eh->e_shnum * eh->e_shentsize);
+}
+
+bool umm::SvImage::Serialize(const UmSV &sv, const unsigned char *elf_start,
+                             std::vector<uint8_t> &out) {
+  if (sv.parent_ != nullptr) {
+    kprintf_force(RED "SvImage: delta snapshots can't be serialized\n" RESET);
+    return false;
+  }
+  if (sv.pth.Root() == nullptr) {
+    kprintf_force(RED "SvImage: not a snapshot\n" RESET);
+    return false;
+  }
+
+  // Keeps the cold store from freezing pages under the walk.
+  sv.AddUser();
+  std::vector<Page> pages;
+  ImageVisitor v(pages);
+  UmPgTblMgmt::walkPgTbl(sv.pth.Root(), PDPT_LEVEL, UmPgTblMgmt::kSlotWalkBase,
+                         v);
+  pages.erase(std::remove_if(pages.begin(), pages.end(),
+                             [&sv](const Page &p) {
+                               return prebuilt(sv, p.vaddr);
+                             }),
+              pages.end());
+
+  Header h;
+  std::memset(&h, 0, sizeof(h));
+  std::memcpy(h.magic, kMagic, sizeof(h.magic));
+  h.version = kVersion;
+  h.ef_size = sizeof(ExceptionFrame);
+  h.elf_id = ElfId(elf_start);
+  h.nregions = sv.region_list_.size();
+  h.npages = pages.size();
+  h.region_off = align_up(sizeof(Header), 8);
+  h.index_off = h.region_off + h.nregions * sizeof(RegionRec);
+  h.data_off = align_up(h.index_off + h.npages * sizeof(PageRec), kPageSize);
+  h.len = h.data_off;
+  for (auto &p : pages)
+    h.len += pgBytes[p.lvl];
+  h.ef = sv.ef;
+
+  size_t base = out.size();
+  out.resize(base + h.len, 0);
+  uint8_t *img = out.data() + base;
+  std::memcpy(img, &h, sizeof(h));
+
+  auto rec = (RegionRec *)(img + h.region_off);
+  for (const auto &reg : sv.region_list_) {
+    kassert(reg.name.size() < sizeof(rec->name));
+    rec->start = reg.start;
+    rec->length = reg.length;
+    rec->fault_around = reg.fault_around;
+    rec->data = reg.data ? reg.data - elf_start : -1;
+    rec->writable = reg.writable;
+    rec->page_order = reg.page_order;
+    std::snprintf(rec->name, sizeof(rec->name), "%s", reg.name.c_str());
+    rec++;
+  }
+
+  auto pr = (PageRec *)(img + h.index_off);
+  uint64_t off = 0;
+  for (auto &p : pages) {
+    pr->vaddr = p.vaddr;
+    pr->lvl = p.lvl;
+    simple_pte e = p.pte;
+    auto frame = e.pageTabEntToAddr(p.lvl).raw;
+    e.decompCommon.PG_TBL_ADDR = off >> SMALL_PG_SHIFT;
+    pr->entry = e.raw;
+    std::memcpy(img + h.data_off + off, (const void *)frame, pgBytes[p.lvl]);
+    off += pgBytes[p.lvl];
+    pr++;
+  }
+  sv.RemoveUser();
+  return true;
+}
+
+umm::UmSV *umm::SvImage::Restore(const uint8_t *img, size_t len,
+                                 unsigned char *elf_start, bool in_place) {
+  auto h = (const Header *)img;
+  if (len < sizeof(Header) || std::memcmp(h->magic, kMagic, sizeof(kMagic))) {
+    kprintf_force(RED "SvImage: bad magic\n" RESET);
+    return nullptr;
+  }
+  if (h->version != kVersion || h->ef_size != sizeof(ExceptionFrame)) {
+    kprintf_force(RED "SvImage: version %u, expected %u\n" RESET, h->version,
+                  kVersion);
+    return nullptr;
+  }
+  if (h->len > len) {
+    kprintf_force(RED "SvImage: truncated, %lu of %lu bytes\n" RESET, len,
+                  h->len);
+    return nullptr;
+  }
+  if (!in_bounds(h)) {
+    kprintf_force(RED "SvImage: corrupt, records out of bounds\n" RESET);
+    return nullptr;
+  }
+  if (h->elf_id != ElfId(elf_start)) {
+    kprintf_force(RED "SvImage: taken on a different ELF\n" RESET);
+    return nullptr;
+  }
+
+  // Loads the symbol table and maps read only sections, the regions are
+  // replaced below.
+  auto sv = &ElfLoader::createSVFromElf(elf_start);
+  sv->region_list_.clear();
+  auto rec = (const RegionRec *)(img + h->region_off);
+  for (uint32_t i = 0; i < h->nregions; i++, rec++) {
+    Region reg;
+    reg.name = std::string(rec->name, strnlen(rec->name, sizeof(rec->name)));
+    reg.start = rec->start;
+    reg.length = rec->length;
+    reg.fault_around = rec->fault_around;
+    reg.data = rec->data < 0 ? nullptr : elf_start + rec->data;
+    reg.writable = rec->writable;
+    reg.page_order = rec->page_order;
+    sv->AddRegion(reg);
+  }
+  sv->ef = h->ef;
+  sv->captured_ = true;
+
+  simple_pte *root = sv->pth.Root();
+  auto pr = (const PageRec *)(img + h->index_off);
+  for (uint32_t i = 0; i < h->npages; i++, pr++) {
+    // Mapped already, images from before the read only tables carry them.
+    if (prebuilt(*sv, pr->vaddr))
+      continue;
+    simple_pte e;
+    e.raw = pr->entry;
+    auto src = img + h->data_off +
+               ((uint64_t)e.decompCommon.PG_TBL_ADDR << SMALL_PG_SHIFT);
+    uintptr_t frame;
+    bool copied = false;
+    if (in_place && pr->lvl == TBL_LEVEL && (uintptr_t)src % kPageSize == 0) {
+      // Never freed, like the ELF's pages. Clones copy it on write.
+      frame = (uintptr_t)src;
+    } else {
+      auto pfn = pg_magazine->Alloc(UmPgMagazine::data, orders[pr->lvl]);
+      kbugon(pfn == Pfn::None());
+      frame = pfn.ToAddr();
+      std::memcpy((void *)frame, src, pgBytes[pr->lvl]);
+      copied = true;
+    }
+    e.decompCommon.PG_TBL_ADDR = frame >> SMALL_PG_SHIFT;
+    lin_addr virt;
+    virt.raw = pr->vaddr;
+    root = UmPgTblMgmt::findAndSetPTE(root, &e, virt, PDPT_LEVEL, pr->lvl,
+                                      PDPT_LEVEL);
+    // The entry took its own reference.
+    if (copied)
+      FrameRef::Put(frame);
+  }
+  if (root != nullptr && sv->pth.Root() == nullptr)
+    sv->pth.SetRoot(root);
+  return sv;
+}
+
+umm::UmSV *umm::SvImage::RestoreLinked(unsigned char *elf_start) {
+  if (&_sv_image_start == nullptr)
+    return nullptr;
+  kprintf_force(YELLOW "Restoring snapshot image at %p\n" RESET,
+                &_sv_image_start);
+  return Restore(&_sv_image_start, &_sv_image_end - &_sv_image_start,
+                 elf_start, /* in_place = */ true);
+}
+
+void umm::SvImage::Dump(const std::vector<uint8_t> &img) {
+  static const char hex[] = "0123456789abcdef";
+  const size_t kLine = 64;
+  char buf[2 * kLine + 1];
+  kprintf_force("SvImage begin %lu\n", img.size());
+  for (size_t i = 0; i < img.size(); i += kLine) {
+    size_t n = std::min(kLine, img.size() - i);
+    for (size_t j = 0; j < n; j++) {
+      buf[2 * j] = hex[img[i + j] >> 4];
+      buf[2 * j + 1] = hex[img[i + j] & 0xf];
+    }
+    buf[2 * n] = '\0';
+    kprintf_force("%s\n", buf);
+  }
+  kprintf_force("SvImage end\n");
+}
@@ -0,0 +1,89 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef UMM_UM_SV_IMAGE_H_
+#define UMM_UM_SV_IMAGE_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "UmSV.h"
+
+// Snapshot image linked into the monitor, see usr/umm-image.
+extern unsigned char _sv_image_start __attribute__((weak));
+extern unsigned char _sv_image_end __attribute__((weak));
+
+namespace umm {
+
+/**
+ *  SvImage - Snapshot in a flat binary image, to be restored after a reboot
+ *  instead of booting the target again. The image only holds what a run
+ *  changed, sections and symbols still come from the ELF it was taken on.
+ *
+ *  Layout, offsets are from the start of the image:
+ *    Header     - Version, counts and offsets, the exception frame.
+ *    RegionRec  - One per region.
+ *    PageRec    - One per mapped page, by increasing address.
+ *    Page data  - Page aligned, in PageRec order.
+ *  Everything a record refers to comes after it, the image can be read front
+ *  to back.
+ */
+namespace SvImage {
+const char kMagic[8] = {'U', 'M', 'M', 'S', 'V', 'I', 'M', 'G'};
+// Bump on any change to the records below.
+const uint32_t kVersion = 1;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t ef_size;    // sizeof(ExceptionFrame) of the monitor that wrote it
+  uint64_t elf_id;     // Hash of the ELF headers, see ElfId
+  uint32_t nregions;
+  uint32_t npages;
+  uint64_t region_off;
+  uint64_t index_off;
+  uint64_t data_off;   // Page aligned
+  uint64_t len;        // Whole image
+  ExceptionFrame ef;
+};
+
+struct RegionRec {
+  uint64_t start;
+  uint64_t length;
+  uint64_t fault_around;
+  int64_t data;        // Offset of the backing data in the ELF, -1 for none
+  uint8_t writable;
+  uint8_t page_order;
+  uint8_t pad[6];
+  char name[32];
+};
+
+struct PageRec {
+  uint64_t vaddr;
+  uint64_t entry;      // Leaf entry, address bits hold the 4K page number of
+                       // its data from data_off
+  uint8_t lvl;         // TBL_LEVEL or DIR_LEVEL
+  uint8_t pad[7];
+};
+
+/** Identifies the ELF an image goes with */
+uint64_t ElfId(const unsigned char *elf_start);
+/** Append the image of sv, a full snapshot taken on the ELF at elf_start.
+ *  False for delta snapshots, they depend on their parent */
+bool Serialize(const UmSV &sv, const unsigned char *elf_start,
+               std::vector<uint8_t> &out);
+/** New snapshot from the image at img, nullptr if it's malformed or was
+ *  taken on another ELF. With in_place 4K pages are mapped from the image
+ *  itself, which then must never be freed */
+UmSV *Restore(const uint8_t *img, size_t len, unsigned char *elf_start,
+              bool in_place = false);
+/** Restore the image linked in with usr/umm-image, nullptr if there's none */
+UmSV *RestoreLinked(unsigned char *elf_start);
+/** Print the image on the console in hex, usr/umm-image turns the log of a
+ *  run back into a linkable image */
+void Dump(const std::vector<uint8_t> &img);
+} // namespace SvImage
+} // namespace umm
+
+#endif // UMM_UM_SV_IMAGE_H_
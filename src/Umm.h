@@ -8,10 +8,13 @@
 /** Umm.h
  *  Client header for interaction with the Umm library
  */
+#include "UmDedup.h"
 #include "UmInstance.h"
 #include "UmLoader.h"
 #include "UmManager.h"
+#include "UmPgMagazine.h"
 #include "UmSV.h"
+#include "UmSvImage.h"
 #include "umm-solo5.h" // SOLO5_USR_REGION_SIZE
 
 #endif // UMM_UMM_H_
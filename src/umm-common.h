@@ -10,6 +10,11 @@
  */
 
 #define UMM_REGION_PAGE_ORDER 0  //  2^i pages
+#define UMM_USR_REGION_PAGE_ORDER 9  // 2MB pages for the usr heap
+#define UMM_REGION_FAULT_AROUND 16   // Pages mapped per read fault, pow2 <= 512
+#define UMM_INSTANCE_PAGE_QUOTA 0    // 4K pages an instance may own, 0 for no cap
+#define UMM_PREBUILT_RO_TABLES 1     // Map .text and .rodata when the ELF loads
+#define UMM_SHARED_ZERO_FRAME 1      // Read faults on zero-fill 4K pages share a frame
 
 #include <cstdint>
 #include <list>   // region list
@@ -0,0 +1,160 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+#ifndef UTIL_LZ_H_
+#define UTIL_LZ_H_
+
+/** lz.h
+ *  Small LZ77 block codec in the style of LZ4, sized for single pages.
+ *  A block is a run of sequences, each a token byte (literal count in the high
+ *  nibble, match length - 4 in the low), extra length bytes when a nibble is
+ *  15, the literals, then a 2 byte little endian match offset. The last
+ *  sequence has literals only.
+ */
+#include <stdint.h>
+#include <string.h>
+
+namespace lz {
+
+const size_t kMinMatch = 4;
+const int kHashBits = 12;
+// Blocks are at most 64K so offsets fit in 2 bytes.
+const size_t kMaxBlock = 1 << 16;
+
+namespace detail {
+inline uint32_t load32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint32_t hash32(uint32_t v) {
+  return (v * 2654435761U) >> (32 - kHashBits);
+}
+
+inline size_t put_len(uint8_t *dst, size_t len) {
+  size_t n = 0;
+  for (; len >= 255; len -= 255)
+    dst[n++] = 255;
+  dst[n++] = len;
+  return n;
+}
+
+// Worst case bytes a sequence takes.
+inline size_t seq_bound(size_t lit, size_t match) {
+  return 1 + (lit / 255 + 1) + lit + 2 + (match / 255 + 1);
+}
+} // namespace detail
+
+/** Compress n bytes of src, returns the compressed length or 0 if it doesn't
+ *  fit in cap bytes */
+inline size_t Compress(const uint8_t *src, size_t n, uint8_t *dst,
+                       size_t cap) {
+  if (n > kMaxBlock)
+    return 0;
+  using namespace detail;
+  uint16_t table[1 << kHashBits];
+  memset(table, 0, sizeof(table));
+
+  size_t ip = 0, anchor = 0, op = 0;
+  while (n >= kMinMatch && ip <= n - kMinMatch) {
+    uint32_t seq = load32(src + ip);
+    uint32_t h = hash32(seq);
+    size_t ref = table[h];
+    table[h] = ip;
+    if (ref >= ip || load32(src + ref) != seq) {
+      // Skip ahead faster the longer nothing matched.
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    size_t len = kMinMatch;
+    while (ip + len < n && src[ref + len] == src[ip + len])
+      len++;
+
+    size_t lit = ip - anchor;
+    size_t ml = len - kMinMatch;
+    if (op + seq_bound(lit, ml) > cap)
+      return 0;
+    uint8_t *token = dst + op++;
+    *token = ((lit < 15 ? lit : 15) << 4) | (ml < 15 ? ml : 15);
+    if (lit >= 15)
+      op += put_len(dst + op, lit - 15);
+    memcpy(dst + op, src + anchor, lit);
+    op += lit;
+    size_t off = ip - ref;
+    dst[op++] = off & 0xff;
+    dst[op++] = off >> 8;
+    if (ml >= 15)
+      op += put_len(dst + op, ml - 15);
+
+    ip += len;
+    anchor = ip;
+  }
+
+  // Trailing literals.
+  size_t lit = n - anchor;
+  if (op + seq_bound(lit, 0) > cap)
+    return 0;
+  dst[op++] = (lit < 15 ? lit : 15) << 4;
+  if (lit >= 15)
+    op += put_len(dst + op, lit - 15);
+  memcpy(dst + op, src + anchor, lit);
+  return op + lit;
+}
+
+/** Decompress len bytes of src into exactly n bytes of dst, false if the
+ *  block is malformed */
+inline bool Decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                       size_t n) {
+  size_t ip = 0, op = 0;
+  auto get_len = [&](size_t base) -> size_t {
+    uint8_t b;
+    do {
+      if (ip >= len)
+        return SIZE_MAX;
+      b = src[ip++];
+      base += b;
+    } while (b == 255);
+    return base;
+  };
+
+  while (ip < len) {
+    uint8_t token = src[ip++];
+    size_t lit = token >> 4;
+    if (lit == 15 && (lit = get_len(lit)) == SIZE_MAX)
+      return false;
+    if (lit > len - ip || lit > n - op)
+      return false;
+    memcpy(dst + op, src + ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == len)
+      break;
+
+    if (len - ip < 2)
+      return false;
+    size_t off = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    size_t ml = token & 0xf;
+    if (ml == 15 && (ml = get_len(ml)) == SIZE_MAX)
+      return false;
+    ml += kMinMatch;
+    if (off == 0 || off > op || ml > n - op)
+      return false;
+    // Matches may overlap their own output, words are safe 8 bytes back.
+    size_t i = 0;
+    if (off >= 8)
+      for (; i + 8 <= ml; i += 8)
+        memcpy(dst + op + i, dst + op - off + i, 8);
+    for (; i < ml; i++)
+      dst[op + i] = dst[op - off + i];
+    op += ml;
+  }
+  return op == n;
+}
+
+} // namespace lz
+
+#endif // UTIL_LZ_H_
@@ -67,6 +67,38 @@ typedef struct {
   enum RW_VALUES { INEXECUTION = 0, DATAWRITE = 1, IORW = 2, DATARW = 3 };
 } DR7;
 
+// CR3, layout with CR4.PCIDE set (Vol 3A, 4.5).
+typedef struct {
+  union {
+    uint64_t val;
+    struct {
+      uint64_t PCID : 12, PG_TBL_ADDR : 40, : 11,
+          NOFLUSH : 1; // Write only, keep translations tagged with PCID.
+    } __attribute__((packed));
+  };
+  void get() { __asm__ __volatile__("mov %%cr3, %0" : "=r"(val)); }
+  void set() { __asm__ __volatile__("mov %0, %%cr3" ::"r"(val) : "memory"); }
+} CR3;
+
+// CR4
+typedef struct {
+  union {
+    uint64_t val;
+    struct {
+      uint64_t : 17, PCIDE : 1, : 46;
+    } __attribute__((packed));
+  };
+  void get() { __asm__ __volatile__("mov %%cr4, %0" : "=r"(val)); }
+  void set() { __asm__ __volatile__("mov %0, %%cr4" ::"r"(val)); }
+} CR4;
+
+// CPUID.01H:ECX.PCID
+inline bool PCIDSupported() {
+  uint32_t eax = 1, ebx, ecx = 0, edx;
+  __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+  return (ecx >> 17) & 0x1;
+}
+
   // Pg fault error code (Vol 3A, Fig 4-12).
   typedef struct {
     union {
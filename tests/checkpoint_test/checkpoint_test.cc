@@ -90,15 +90,74 @@ void singleCoreTest(){
   auto run_duration = duration_cast<microseconds>(end_run - start_run);
   cout << "Run duration: " << run_duration.count() << " microseconds" << endl;
 
-  cout << "Snapshot is this many pages: " << umm::manager->num_cp_pgs << endl;
+  cout << "Snapshot is this many pages: " << snap->CountOwnedPages() << endl;
 
 }
 
+// Time the capture of the same checkpoint copied on 1 core, split across
+// helper cores, and taken lazily.
+void captureTest(){
+  struct Mode {
+    const char *name;
+    size_t helpers;
+    bool lazy;
+  };
+  std::vector<Mode> modes = {{"1 core", 0, false},
+                             {"all cores", ebbrt::Cpu::Count() - 1, false},
+                             {"lazy", 0, true}};
+  for (const auto &m : modes) {
+    umm::manager->capture_helpers = m.helpers;
+    auto umi = initInstance();
+    ebbrt::Future<umm::UmSV *> snap_f = umi->SetCheckpoint(
+        umm::ElfLoader::GetSymbolAddress("uv_uptime"), false, m.lazy);
+
+    umm::manager->ctr_list.clear();
+    umi = std::move(umm::manager->Run(std::move(umi)));
+    snap_f.Get();
+
+    // "Check" is the checkpoint handler, the capture is most of it. Writes
+    // after a lazy capture show up as cow faults instead.
+    for (const auto &e : umm::manager->ctr_list) {
+      if (e.s_ == "Check")
+        cout << "Capture " << m.name << ": " << e.cycles_ << " cycles, "
+             << umi->pfc.cowFaults << " cow faults" << endl;
+    }
+  }
+  umm::manager->capture_helpers = UMM_CAPTURE_HELPERS;
+}
+
+// The instance rewrites the pages it owned before a lazy capture, each one is
+// copied and charged again. With those handed to the snapshot, the pages an
+// eager run ends up with cover the lazy run too.
+void quotaTest(){
+  auto umi = initInstance();
+  ebbrt::Future<umm::UmSV *> snap_f = umi->SetCheckpoint(
+      umm::ElfLoader::GetSymbolAddress("uv_uptime"));
+  umi = std::move(umm::manager->Run(std::move(umi)));
+  snap_f.Get();
+  size_t quota = umi->CountOwnedPages();
+
+  umi = initInstance();
+  umi->page_quota = quota;
+  snap_f = umi->SetCheckpoint(umm::ElfLoader::GetSymbolAddress("uv_uptime"),
+                              false, /* lazy = */ true);
+  umi = std::move(umm::manager->Run(std::move(umi)));
+  snap_f.Get();
+
+  cout << "Quota " << quota << " pages, lazy run owns "
+       << umi->CountOwnedPages() << " after " << umi->pfc.cowFaults
+       << " cow faults" << endl;
+  kassert(!umi->quota_exceeded);
+  kassert(umi->CountOwnedPages() <= quota);
+}
+
 void AppMain() {
 
   // Initialize the UmManager
   umm::UmManager::Init();
   singleCoreTest();
+  captureTest();
+  quotaTest();
   // twoCoreTest();
   cout << "powering off: " << endl;
   ebbrt::acpi::PowerOff();
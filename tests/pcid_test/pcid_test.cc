@@ -210,8 +210,62 @@ simple_pte* newPT(uintptr_t virt_addr, uintptr_t phys_addr){
   return root;
 }
 
+// Slot switch benchmark. Two address spaces take turns in the slot the way
+// UmManager swaps instances, each touching its pages once loaded.
+#define BENCH_PAGES 64
+#define BENCH_SWITCHES (1 << 16)
+
+uint64_t rdtsc() {
+  uint32_t lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+simple_pte *benchSlotTree() {
+  simple_pte *root = nullptr;
+  for (uint64_t i = 0; i < BENCH_PAGES; i++) {
+    lin_addr virt, phys;
+    virt.raw = kSlotStartVAddr + (i << SMALL_PG_SHIFT);
+    phys.raw = getPage();
+    root = UmPgTblMgmt::mapIntoPgTbl(root, phys, virt, PDPT_LEVEL, TBL_LEVEL,
+                                     PDPT_LEVEL, false);
+  }
+  return root;
+}
+
+void benchSlotSwitch(simple_pte **trees, bool pcid) {
+  simple_pte *slot = UmPgTblMgmt::getPML4Root() + kSlotPML4Offset;
+  kassert(!UmPgTblMgmt::exists(slot));
+
+  uint64_t start = rdtsc();
+  for (int s = 0; s < BENCH_SWITCHES; s++) {
+    int t = s & 1;
+    // Load, the first use of each PCID flushes it.
+    slot->setPte(trees[t], false, true, true, true);
+    if (pcid)
+      UmPgTblMgmt::loadPCID(t + 1, s < 2);
+
+    for (uint64_t i = 0; i < BENCH_PAGES; i++)
+      (void)*(volatile uint64_t *)(kSlotStartVAddr + (i << SMALL_PG_SHIFT));
+
+    // Unload.
+    slot->clearPTE();
+    if (pcid)
+      UmPgTblMgmt::loadPCID(0, false);
+    else
+      UmPgTblMgmt::flushTranslationCaches();
+  }
+  uint64_t cycles = rdtsc() - start;
+
+  ebbrt::kprintf_force(CYAN "%s: %lu cycles per switch, %d pages touched\n" RESET,
+                       pcid ? "PCID" : "Flush", cycles / BENCH_SWITCHES,
+                       BENCH_PAGES);
+}
+
 void AppMain() {
   ebbrt::kprintf_force(YELLOW "Hi from %s\n" RESET, __func__);
+  // Page table pages come from the magazine.
+  UmPgMagazine::Init();
 
   lin_addr slotLA;
   slotLA.raw = (uint64_t) testAddrSpcSwitchWithoutPCID;
@@ -221,6 +275,12 @@ void AppMain() {
     UmPgTblMgmt::dumpAllPTEsWalkLamb(slotLA, otherPT, PML4_LEVEL);
   }
 
+  // Switch cost before and after PCIDs, the tests below spin for a debugger.
+  simple_pte *trees[2] = {benchSlotTree(), benchSlotTree()};
+  benchSlotSwitch(trees, false);
+  if (UmPgTblMgmt::enablePCID())
+    benchSlotSwitch(trees, true);
+
   ebbrt::kprintf_force(YELLOW "Starting Without PCID test\n" RESET);
   testAddrSpcSwitchWithoutPCID(otherPT);
   ebbrt::kprintf_force(GREEN "Done Without PCID test\n" RESET);
@@ -0,0 +1,104 @@
+//          Copyright Boston University SESA Group 2013 - 2018.
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+#include <cstring>
+
+#include <UmPgCopy.h>
+#include <Umm.h>
+#include <ebbrt/Debug.h>
+#include <ebbrt/native/Acpi.h>
+#include <ebbrt/native/PageAllocator.h>
+
+using namespace umm;
+using ebbrt::pmem::kPageSize;
+
+// Page copy kernels against memcpy. A snapshot sized set streams through
+// memory, a COW sized set is copied and read back right away the way a guest
+// touches a page it just faulted.
+#define BENCH_BIG_ORDER 14 // 64MB, past the LLC
+#define BENCH_COW_PAGES 8
+#define BENCH_COW_ROUNDS (1 << 14)
+
+typedef void (*copy_fn)(void *dst, const void *src, size_t bytes);
+
+void libcCopy(void *dst, const void *src, size_t bytes) {
+  std::memcpy(dst, src, bytes);
+}
+
+struct Kernel {
+  const char *name;
+  copy_fn fn;
+};
+const Kernel kernels[] = {{"memcpy", libcCopy},
+                          {"copy", PgCopy::Copy},
+                          {"stream", PgCopy::Stream}};
+
+uint64_t rdtsc() {
+  uint32_t lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+unsigned char *getPages(uint8_t order) {
+  auto pfn = ebbrt::page_allocator->Alloc(order);
+  ebbrt::kbugon(pfn == ebbrt::Pfn::None());
+  auto p = (unsigned char *)pfn.ToAddr();
+  // Fault nothing in during the runs, and copy something other than zeros.
+  for (size_t i = 0; i < (kPageSize << order); i++)
+    p[i] = i * 31;
+  return p;
+}
+
+uint64_t readPage(const unsigned char *p) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < kPageSize / sizeof(uint64_t); i++)
+    sum += ((const uint64_t *)p)[i];
+  return sum;
+}
+
+// Snapshot capture, every page copied once and left alone.
+void benchSnapshot(const Kernel &k, unsigned char *dst,
+                   const unsigned char *src) {
+  const size_t pages = 1UL << BENCH_BIG_ORDER;
+  uint64_t start = rdtsc();
+  for (size_t i = 0; i < pages; i++)
+    k.fn(dst + i * kPageSize, src + i * kPageSize, kPageSize);
+  uint64_t cycles = rdtsc() - start;
+  ebbrt::kprintf_force(CYAN "snapshot %s: %lu cycles per page\n" RESET, k.name,
+                       cycles / pages);
+}
+
+// COW fault, the copy is read as soon as it's mapped.
+void benchCOW(const Kernel &k, unsigned char *dst, const unsigned char *src) {
+  uint64_t sum = 0;
+  uint64_t start = rdtsc();
+  for (size_t r = 0; r < BENCH_COW_ROUNDS; r++) {
+    size_t i = r % BENCH_COW_PAGES;
+    k.fn(dst + i * kPageSize, src + i * kPageSize, kPageSize);
+    sum += readPage(dst + i * kPageSize);
+  }
+  uint64_t cycles = rdtsc() - start;
+  ebbrt::kprintf_force(CYAN "cow %s: %lu cycles per page (%lx)\n" RESET,
+                       k.name, cycles / BENCH_COW_ROUNDS, sum);
+}
+
+void AppMain() {
+  auto src = getPages(BENCH_BIG_ORDER);
+  auto dst = getPages(BENCH_BIG_ORDER);
+
+  for (const auto &k : kernels) {
+    k.fn(dst, src, kPageSize << BENCH_BIG_ORDER);
+    kassert(std::memcmp(dst, src, kPageSize << BENCH_BIG_ORDER) == 0);
+    std::memset(dst, 0, kPageSize << BENCH_BIG_ORDER);
+  }
+
+  for (const auto &k : kernels)
+    benchSnapshot(k, dst, src);
+  for (const auto &k : kernels)
+    benchCOW(k, dst, src);
+
+  ebbrt::kprintf_force(GREEN "Done\n" RESET);
+  ebbrt::acpi::PowerOff();
+}
@@ -396,6 +396,47 @@ void testReclaimAllPages(simple_pte *root){
   UmPgTblMgmt::freePageTableLamb(root, PDPT_LEVEL);
 }
 
+// Compare a plain recursive walk with the templated walker, counting the
+// valid pages of the kernel's page table.
+#define WALK_BENCH_ITERS 100
+
+void countValidPagesRec(std::vector<uint64_t> &counts, simple_pte *root,
+                        uint8_t lvl) {
+  for (int i = 0; i < 512; i++) {
+    if (!UmPgTblMgmt::exists(root + i))
+      continue;
+    if (UmPgTblMgmt::isLeaf(root + i, lvl))
+      counts[lvl]++;
+    else
+      countValidPagesRec(counts,
+                         UmPgTblMgmt::nextTableOrFrame(root, i, lvl), lvl - 1);
+  }
+}
+
+void benchWalkers(){
+  printf(YELLOW "%s\n" RESET, __func__);
+  simple_pte *root = UmPgTblMgmt::getPML4Root();
+  std::vector<uint64_t> counts(5), counts2(5);
+
+  auto start = ebbrt::clock::Wall::Now();
+  for (int i = 0; i < WALK_BENCH_ITERS; i++)
+    countValidPagesRec(counts, root, PML4_LEVEL);
+  auto mid = ebbrt::clock::Wall::Now();
+  for (int i = 0; i < WALK_BENCH_ITERS; i++)
+    UmPgTblMgmt::countValidPagesLamb(counts2, root, PML4_LEVEL);
+  auto end = ebbrt::clock::Wall::Now();
+
+  kassert(counts == counts2);
+  printCounts(counts2);
+  auto us = [](ebbrt::clock::Wall::time_point a,
+               ebbrt::clock::Wall::time_point b) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(b - a)
+        .count() / WALK_BENCH_ITERS;
+  };
+  printf(CYAN "recursive walk: %lu us, templated walk: %lu us\n" RESET,
+         us(start, mid), us(mid, end));
+}
+
 void AppMain() {
   // Note looks like Valid pages count works.
   // testCountValidPages();
@@ -414,6 +455,8 @@ void AppMain() {
   // testCountValidPTEs();
   // testCountValidPTEsLamb();
 
+  benchWalkers();
+
   // Get physical address for virt.
   runHelloWorld();
   lin_addr la; la.raw = 0xffffc00000000000;
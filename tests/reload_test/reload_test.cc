@@ -36,8 +36,27 @@ const umm::UmSV* getSnap(){
   return snap_f.Get();
 }
 
+// Round trip the snapshot through an image, as a restore after a reboot would.
+const umm::UmSV* imageSnap(const umm::UmSV* snap){
+  std::vector<uint8_t> img;
+  if (!umm::SvImage::Serialize(*snap, &_sv_start, img))
+    ebbrt::kabort("Failed to serialize snapshot\n");
+  ebbrt::kprintf_force(CYAN "Snapshot image is %lu bytes\n" RESET, img.size());
+#ifdef DUMP_IMAGE
+  // Log of the run, through usr/umm-image, gives a linkable image.
+  umm::SvImage::Dump(img);
+#endif
+  auto restored = umm::SvImage::Restore(img.data(), img.size(), &_sv_start);
+  if (restored == nullptr)
+    ebbrt::kabort("Failed to restore snapshot image\n");
+  return restored;
+}
+
 void loadFromSnapTest(int numRuns){
-  auto snap = getSnap();
+  // A linked image skips the boot, see usr/umm-image.
+  const umm::UmSV *snap = umm::SvImage::RestoreLinked(&_sv_start);
+  if (snap == nullptr)
+    snap = imageSnap(getSnap());
 
   for(int i = 0; i < numRuns; i++){
     printf(RED "\n\n***** Deploying snapshot %d\n" RESET, i);
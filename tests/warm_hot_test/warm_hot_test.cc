@@ -20,6 +20,7 @@
 #include <InvocationSession.h>
 
 #include <chrono>
+#include <cstring>
 #include <iostream>
 #include <list>
 std::list<int> u_sec_list;
@@ -99,6 +100,7 @@ const std::string my_cmd = R"({"cmdline":"bin/node-default /nodejsActionBase/app
 umm::UmSV* snap_sv;
 umm::UmSV* opt_base_sv;
 umm::UmSV* warm_sv;
+umm::UmSV* full_sv;
 
 umm::UmSV& getSVFromElf(){
   // Generated UM Instance from the linked in Elf
@@ -256,6 +258,10 @@ void regHaltOnClose(auto umsesh){
 }
 
 void generateBaseEnvtSnapshot(){
+  // Image of the snapshot linked in, no need to boot node, see usr/umm-image.
+  snap_sv = umm::SvImage::RestoreLinked(&_sv_start);
+  if (snap_sv != nullptr)
+    return;
 
   // Use ELF to make SV, use sv to make umi.
   std::unique_ptr<umm::UmInstance> umi = getUMIFromSV( getSVFromElf() );
@@ -287,9 +293,10 @@ void generateBaseEnvtSnapshotOpt(){
   // Deploy from orig snap.
   auto umi = getUMIFromSV( *snap_sv );
 
-  // Optimized snap
+  // Optimized snap, layered on the base snapshot.
   ebbrt::Future<umm::UmSV *> opt_base_f =
-    umi->SetCheckpoint(umm::ElfLoader::GetSymbolAddress("uv_uptime"));
+    umi->SetCheckpoint(umm::ElfLoader::GetSymbolAddress("uv_uptime"),
+                       /* delta = */ true);
 
   // using global opt_base_sv pointer.
   regSnapshot(&opt_base_sv, &opt_base_f);
@@ -338,8 +345,10 @@ void generateWarmSnapshot(bool optimize) {
   auto umi = getUMIFromSV( *snap );
 
 
+  // Warm snap only stores the pages touched by init.
   ebbrt::Future<umm::UmSV *> warm_sv_f =
-    umi->SetCheckpoint(umm::ElfLoader::GetSymbolAddress("uv_uptime"));
+    umi->SetCheckpoint(umm::ElfLoader::GetSymbolAddress("uv_uptime"),
+                       /* delta = */ true);
 
   // Uses global warm_sv.
   regSnapshot(&warm_sv, &warm_sv_f);
@@ -599,6 +608,9 @@ void warmTest(){
   bool useOpt = true;
   generateWarmSnapshot(useOpt);
 
+  // First warm start records its working set, the rest prefetch it.
+  warm_sv->EnableWorkingSetPrefetch();
+
   // This bloats warm snap.
   // Have to modify js code to use this one.
   // This is the worse way to optimize latency.
@@ -627,12 +639,68 @@ void hotTest(){
 
 }
 
+// Address of vaddr's byte in the page sv maps for it, 0 if sv's own tables
+// don't map it. With chain set, ancestors are searched too.
+uintptr_t pageData(const umm::UmSV &sv, uintptr_t vaddr, bool chain) {
+  umm::lin_addr la;
+  la.raw = vaddr;
+  uint8_t lvl = TBL_LEVEL;
+  auto pte = umm::UmPgTblMgmt::findLeafPTE(sv.pth.Root(), PDPT_LEVEL, la, &lvl);
+  if (pte == nullptr && chain)
+    pte = sv.GetParentPTE(vaddr, &lvl);
+  if (pte == nullptr)
+    return 0;
+  return pte->pageTabEntToAddr(lvl).raw + (vaddr & (pgBytes[lvl] - 1));
+}
+
+void fullFromDeltaTest(){
+  ebbrt::kprintf_force(YELLOW "Full capture of a delta clone\n" RESET);
+
+  // opt_base_sv only stores what /preInit and /preRun wrote over snap_sv.
+  generateBaseEnvtSnapshotOpt();
+  auto umi = getUMIFromSV( *opt_base_sv );
+
+  // Everything the clone sees, not just what it writes.
+  ebbrt::Future<umm::UmSV *> full_sv_f =
+    umi->SetCheckpoint(umm::ElfLoader::GetSymbolAddress("uv_uptime"));
+  regSnapshot(&full_sv, &full_sv_f);
+
+  auto umsesh = create_session();
+  regConnect(&umsesh);
+  regSendInitOnConnect(&umsesh, false);
+  regHaltOnClose(&umsesh);
+  umi = std::move(umm::manager->Run(std::move(umi)));
+
+  // A page only the base snapshot wrote, neither the delta nor the clone
+  // touched it. The full snapshot must still see the base's copy.
+  size_t checked = 0;
+  for (const auto &reg : snap_sv->region_list_) {
+    // Not usr, it spans the rest of the slot.
+    if (!reg.writable || reg.name == "usr")
+      continue;
+    for (uintptr_t va = reg.start; va < reg.start + reg.length;
+         va += ebbrt::pmem::kPageSize) {
+      auto base = pageData(*snap_sv, va, false);
+      if (base == 0 || pageData(*opt_base_sv, va, false) != 0 ||
+          pageData(*full_sv, va, false) != 0)
+        continue;
+      auto full = pageData(*full_sv, va, true);
+      kassert(full != 0);
+      kassert(memcmp((void *)full, (void *)base, ebbrt::pmem::kPageSize) == 0);
+      checked++;
+    }
+  }
+  ebbrt::kprintf_force(GREEN "%lu base only pages match\n" RESET, checked);
+  kassert(checked > 0);
+}
+
 void AppMain() {
   umm::UmManager::Init();
   // timeFullBoot();
   coldTest();
   // warmTest();
   // hotTest();
+  // fullFromDeltaTest();
 
   ebbrt::kprintf_force(CYAN "Done!\n" RESET);
   ebbrt::acpi::PowerOff();